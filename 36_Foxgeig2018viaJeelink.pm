@@ -17,9 +17,9 @@ sub Foxgeig2018viaJeelink_Parse($$);
 sub Foxgeig2018viaJeelink_Initialize($) {
   my ($hash) = @_;
                        # OK CC 21 249 0 0 26 255 255 255 161
-  $hash->{'Match'}     = '^\S+\s+CC\s+\d+\s+249\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s*$';  # FIXME
+  $hash->{'Match'}     = '^\S+\s+CC\s+\d+\s+((249|251|252)\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+|(250|253)(\s+\d+)+)\s*$';  # FIXME
   $hash->{'SetFn'}     = "Foxgeig2018viaJeelink_Set";
-  ###$hash->{'GetFn'}     = "Foxgeig2018viaJeelink_Get";
+  $hash->{'GetFn'}     = "Foxgeig2018viaJeelink_Get";
   $hash->{'DefFn'}     = "Foxgeig2018viaJeelink_Define";
   $hash->{'UndefFn'}   = "Foxgeig2018viaJeelink_Undef";
   $hash->{'FingerprintFn'}   = "Foxgeig2018viaJeelink_Fingerprint";
@@ -91,7 +91,25 @@ sub Foxgeig2018viaJeelink_Get($@) {
 
   return "\"get $name\" needs at least one parameter" if(@_ < 3);
 
-  my $list = "";
+  my $list = "history:noArg";
+
+  if ($cmd eq "history") {
+    # The last history upload, one line per bucket: the time the bucket
+    # ended, the counts and the counts per minute. The times are estimates,
+    # counting back from when we received the frame.
+    my $h = $hash->{helper}{history};
+    return "no history received yet" if (!defined($h));
+    my $n = int(@{$h->{vals}});
+    my $ret = "";
+    for (my $k = 0; $k < $n; $k++) {
+      my $v = $h->{vals}[$k];
+      my $t = $h->{rcvtime} - ($n - 1 - $k) * $h->{blen} / 64.0;
+      $ret .= FmtDateTime(int($t)) . " "
+            . (defined($v) ? sprintf("%u %.1f", $v, $v * 60.0 * 64.0 / $h->{blen}) : "-")
+            . "\n";
+    }
+    return $ret;
+  }
 
   return "Unknown argument $cmd, choose one of $list";
 }
@@ -127,13 +145,136 @@ sub Foxgeig2018viaJeelink_Set($@) {
   return undef;
 }
 
+#-----------------------------------#
+# The fields of the TLV frames (sensortype 0xfa), by tag. See main.c.
+# Fields with tags that are not in here are skipped, so new fields in the
+# firmware do not break anything, and only need a line here to show up.
+#   name:    the reading
+#   invalid: value that means 'no valid data', the reading is not updated
+#   signed:  value is two's complement
+#   scale:   value is multiplied with this
+#   fmt:     sprintf format for the reading
+my %Foxgeig2018viaJeelink_tlvfields = (
+  0x01 => { name => 'seq' },
+  0x02 => { name => 'cpm1min', invalid => 0xFFFFFF },
+  0x03 => { name => 'cpm60min', invalid => 0xFFFFFF },
+  0x04 => { name => 'ewma1min', invalid => 0xFFFFFF },
+  0x05 => { name => 'ewma60min', invalid => 0xFFFFFF },
+  0x06 => { name => 'batteryLevel', scale => 0.001, fmt => '%.2f' },
+  0x07 => { name => 'vcc', scale => 0.001, fmt => '%.2f' },
+  0x08 => { name => 'mcutemp', signed => 1 },
+  0x09 => { name => 'uptime' },
+  0x0A => { name => 'resetcause' },
+  0x0B => { name => 'stackunused' },
+);
+
+# Decode the payload of a TLV frame (everything after the sensortype) into
+# the readings in %$rd. Returns 0 if the frame is malformed.
+sub Foxgeig2018viaJeelink_ParseTLV($$) {
+  my ($payload, $rd) = @_;
+  my @b = @$payload;
+
+  return 0 if ((int(@b) < 1) || ($b[0] != 1)); # Format version 1
+  my $i = 1;
+  while ($i < int(@b)) {
+    return 0 if ($i + 2 > int(@b));
+    my ($tag, $len) = ($b[$i], $b[$i + 1]);
+    $i += 2;
+    return 0 if ($i + $len > int(@b));
+    my $val = 0;
+    for (my $j = 0; $j < $len; $j++) {
+      $val = ($val << 8) | $b[$i + $j];
+    }
+    $i += $len;
+    my $f = $Foxgeig2018viaJeelink_tlvfields{$tag};
+    next if (!defined($f));
+    next if (defined($f->{invalid}) && ($val == $f->{invalid}));
+    if ($f->{signed} && ($len > 0) && ($val >= (1 << (8 * $len - 1)))) {
+      $val -= (1 << (8 * $len));
+    }
+    $val *= $f->{scale} if (defined($f->{scale}));
+    $val = sprintf($f->{fmt}, $val) if (defined($f->{fmt}));
+    $rd->{$f->{name}} = $val;
+  }
+  return 1;
+}
+
+# The CRC of the frames (see calculatecrc() in main.c)
+sub Foxgeig2018viaJeelink_CRC(@) {
+  my $res = 0;
+  foreach my $byte (@_) {
+    my $val = $byte;
+    for (my $i = 0; $i < 8; $i++) {
+      my $tmp = ($res ^ $val) & 0x80;
+      $res = ($res << 1) & 0xFF;
+      $res ^= 0x31 if ($tmp);
+      $val = ($val << 1) & 0xFF;
+    }
+  }
+  return $res;
+}
+
+# Decode the payload of a history frame (sensortype 0xfd, everything after
+# the sensortype), see sendhistory() in main.c, into %$hist: the number
+# of the newest bucket, the bucket length in 1/64 s and the values of the
+# buckets, oldest first (undef = no data). The nibbles are either the
+# difference to the previous value, zigzag coded (0, -1, +1, -2, ...), or
+# 0xF followed by 4 nibbles with the value. If the receiver passed the CRC
+# on, it is checked. Returns 0 if the frame is malformed.
+sub Foxgeig2018viaJeelink_ParseHistory($$$) {
+  my ($id, $payload, $hist) = @_;
+  my @b = @$payload;
+
+  return 0 if ((int(@b) < 6) || ($b[0] != 1)); # Format version 1
+  my $blen = ($b[3] << 8) | $b[4];
+  my $n = $b[5];
+  return 0 if ($blen == 0);
+  my @nib = map { (($_ >> 4), ($_ & 0x0F)) } @b[6 .. $#b];
+  my $i = 0;
+  my $prev = 0;
+  my @vals;
+  for (my $k = 0; $k < $n; $k++) {
+    return 0 if ($i >= int(@nib));
+    my $x = $nib[$i++];
+    my $v;
+    if ($x == 0x0F) {
+      return 0 if ($i + 4 > int(@nib));
+      $v = ($nib[$i] << 12) | ($nib[$i + 1] << 8) | ($nib[$i + 2] << 4) | $nib[$i + 3];
+      $i += 4;
+    } else {
+      $v = $prev + (($x & 1) ? -(($x + 1) >> 1) : ($x >> 1));
+      return 0 if ($v < 0);
+    }
+    if ($v == 0xFFFF) {
+      push(@vals, undef);
+    } else {
+      push(@vals, $v);
+      $prev = $v;
+    }
+  }
+  return 0 if (($i & 1) && ($nib[$i] != 0)); # Padding
+  my $rest = int(@b) - 6 - int(($i + 1) / 2);
+  if ($rest == 1) {
+    # Byte 2 of the frame counts the bytes after it, without the CRC
+    my $crc = Foxgeig2018viaJeelink_CRC(0xCC, $id, int(@b), 0xFD, @b[0 .. $#b - 1]);
+    return 0 if ($crc != $b[-1]);
+  } elsif ($rest != 0) {
+    return 0;
+  }
+  $hist->{newest} = ($b[1] << 8) | $b[2];
+  $hist->{blen} = $blen;
+  $hist->{vals} = \@vals;
+  return 1;
+}
+
 #-----------------------------------#
 sub Foxgeig2018viaJeelink_Parse($$) {
   my ($hash, $msg) = @_;
   my $name = $hash->{NAME};
 
-  my ( @bytes, $addr, $cpm1min, $cpm60min );
-  my $batvolt = -1.0;
+  my ( @bytes, $addr );
+  my %rd; # the readings we got
+  my %hist; # the history, if that is what we got
 
   if ($msg =~ m/^OK CC /) {
     # OK CC 21 249 0 0 26 255 255 255 161
@@ -147,23 +288,53 @@ sub Foxgeig2018viaJeelink_Parse($$) {
     # Byte  8: CountsPerMinute for last 60 minutes,
     # Byte  9: CountsPerMinute for last 60 minutes, LSB
     # Byte 10: Battery voltage (0-255, 255 = 6.6V)
+    # Sensortype 0xfb has the same layout, but carries the moving averages.
+    # Sensortype 0xfc is a variable integration time measurement:
+    # Byte  4-6: CountsPerMinute, Byte 7-8: integration time in seconds,
+    # Byte  9: relative uncertainty in 0.1%.
+    # Sensortype 0xfa has a variable length, see ParseTLV above.
+    # Sensortype 0xfd is the history, see ParseHistory above.
     @bytes = split( ' ', substr($msg, 6) );
 
-    if (int(@bytes) != 9) {
+    if ((int(@bytes) >= 3) && ($bytes[1] == 0xFD)) {
+      my @payload = @bytes[2 .. $#bytes];
+      if (!Foxgeig2018viaJeelink_ParseHistory($bytes[0], \@payload, \%hist)) {
+        DoTrigger($name, "UNKNOWNCODE $msg");
+        return "";
+      }
+      $rd{"histbuckets"} = int(@{$hist{vals}});
+      $rd{"histnewest"} = $hist{newest};
+    } elsif ((int(@bytes) >= 3) && ($bytes[1] == 0xFA)) {
+      my @payload = @bytes[2 .. $#bytes];
+      if (!Foxgeig2018viaJeelink_ParseTLV(\@payload, \%rd)) {
+        DoTrigger($name, "UNKNOWNCODE $msg");
+        return "";
+      }
+    } elsif (int(@bytes) != 9) {
       DoTrigger($name, "UNKNOWNCODE $msg");
       return "";
-    }
-    if ($bytes[1] != 0xF9) {
+    } elsif ($bytes[1] == 0xFC) {
+      $rd{"vicpm"} = ($bytes[2] << 16) | ($bytes[3] << 8) | ($bytes[4] << 0);
+      $rd{"vitime"} = ($bytes[5] << 8) | ($bytes[6] << 0);
+      $rd{"viuncertainty"} = $bytes[7] / 10.0;
+    } elsif (($bytes[1] == 0xF9) || ($bytes[1] == 0xFB)) {
+      my $rdg = ($bytes[1] == 0xFB) ? "ewma" : "cpm";
+      my $cpm1min = ($bytes[2] << 16) | ($bytes[3] << 8) | ($bytes[4] << 0);
+      my $cpm60min = ($bytes[5] << 16) | ($bytes[6] << 8) | ($bytes[7] << 0);
+      # 0xFFFFFF means the reading is invalid.
+      $rd{"${rdg}1min"} = $cpm1min if ($cpm1min != 0xFFFFFF);
+      $rd{"${rdg}60min"} = $cpm60min if ($cpm60min != 0xFFFFFF);
+    } else {
       DoTrigger($name, "UNKNOWNCODE $msg");
       return "";
     }
+    if (($bytes[1] != 0xFA) && ($bytes[1] != 0xFD)) {
+      $rd{"batteryLevel"} = sprintf("%.2f", (6.6 * $bytes[8] / 255.0));
+    }
 
     #Log3 $name, 3, "$name: $msg cnt ".int(@bytes)." addr ".$bytes[0];
 
     $addr = sprintf( "%02x", $bytes[0] );
-    $cpm1min = ($bytes[2] << 16) | ($bytes[3] << 8) | ($bytes[4] << 0);
-    $cpm60min = ($bytes[5] << 16) | ($bytes[6] << 8) | ($bytes[7] << 0);
-    $batvolt = sprintf("%.2f", (6.6 * $bytes[8] / 255.0));
   } else {
     DoTrigger($name, "UNKNOWNCODE $msg");
     return "";
@@ -200,6 +371,10 @@ sub Foxgeig2018viaJeelink_Parse($$) {
 
   $rhash->{"Foxgeig2018viaJeelink_lastRcv"} = TimeNow();
   $rhash->{"sensorType"} = "Foxgeig2018viaJeelink";
+  if (defined($hist{vals})) {
+    $hist{rcvtime} = time();
+    $rhash->{helper}{history} = \%hist;
+  }
 
   readingsBeginUpdate($rhash);
 
@@ -207,23 +382,17 @@ sub Foxgeig2018viaJeelink_Parse($$) {
   # about it could just as well be in Russian, it's absolutely not understandable
   # (at least for non-seasoned FHEM developers) what this is actually used for.
   readingsBulkUpdate($rhash, "state", "Initialized");
-  # Round and write temperature and humidity
-  if ($cpm1min != 0xFFFFFF) { # 0xFFFFFF means the reading is invalid.
-    readingsBulkUpdate($rhash, "cpm1min", $cpm1min);
-    # The magic 0.0057 value comes from the original mightyohm firmware.
-    # It's pretty much guesswork anyways, because you cannot know how much
-    # of which type of radiation you counted.
-    my $deriveddosage = 0.0057 * $cpm1min;
-    readingsBulkUpdate($rhash, "raddose1min", sprintf("%.3f", $deriveddosage));
+  # The magic 0.0057 value comes from the original mightyohm firmware.
+  # It's pretty much guesswork anyways, because you cannot know how much
+  # of which type of radiation you counted.
+  if (defined($rd{"cpm1min"})) {
+    $rd{"raddose1min"} = sprintf("%.3f", 0.0057 * $rd{"cpm1min"});
   }
-  if ($cpm60min != 0xFFFFFF) { # 0xFFFFFF means the reading is invalid.
-    readingsBulkUpdate($rhash, "cpm60min", $cpm60min);
-    my $deriveddosage = 0.0057 * $cpm60min;
-    readingsBulkUpdate($rhash, "raddose60min", sprintf("%.3f", $deriveddosage));
+  if (defined($rd{"cpm60min"})) {
+    $rd{"raddose60min"} = sprintf("%.3f", 0.0057 * $rd{"cpm60min"});
   }
-
-  if ($batvolt > 0.0) {
-    readingsBulkUpdate($rhash, "batteryLevel", $batvolt);
+  foreach my $r (sort(keys(%rd))) {
+    readingsBulkUpdate($rhash, $r, $rd{$r});
   }
 
   readingsEndUpdate($rhash,1);
@@ -278,6 +447,11 @@ sub Foxgeig2018viaJeelink_Parse($$) {
   <a name="Foxgeig2018viaJeelink_Get"></a>
   <b>Get</b>
   <ul>
+    <li>history<br>
+      the buckets of the last history upload, one per line: the time the bucket
+      ended (estimated from when the upload was received), the counts and the
+      Counts Per Minute. "-" means the sensor has no data for that bucket. Use
+      this to fill the gaps in your logs after the receiver missed some frames.</li>
   </ul><br>
 
   <a name="Foxgeig2018viaJeelink_Readings"></a>
@@ -289,6 +463,24 @@ sub Foxgeig2018viaJeelink_Parse($$) {
       the radiation measurement for the last minute, in Counts Per Minute.</li>
     <li>cpm60min<br>
       the radiation measurement averaged over the last 60 minutes, in Counts Per Minute.</li>
+    <li>ewma1min, ewma60min<br>
+      exponential moving averages with 1 and 60 minutes time constant, in Counts Per Minute.
+      Only sent if the sensor has txavg set to 2.</li>
+    <li>vicpm, vitime, viuncertainty<br>
+      result of the variable integration time measurement: Counts Per Minute,
+      the integration time in seconds and the relative uncertainty in percent.
+      Only sent if the sensor has viuncert set.</li>
+    <li>seq, vcc, mcutemp, uptime, resetcause, stackunused<br>
+      packet sequence number, supply voltage (V), chip temperature, uptime (s),
+      last reset cause (MCUSR) and unused stack bytes. Only in the TLV frames
+      that are sent if the sensor has txformat set to 1 or 2.</li>
+    <li>histbuckets, histnewest<br>
+      number of buckets in the last history upload, and the number of the newest
+      one. The history is uploaded every histupload hours, or on request (console
+      command or downlink command histupload). Those frames are up to 255 bytes
+      long, so the firmware of the receiver needs to handle frames that do not fit
+      into the FIFO of its radio: the stock LaCrosseITPlusReader firmware drops them.
+      See "get history" for the values.</li>
   </ul><br>
 
   <a name="Foxgeig2018viaJeelink_Attr"></a>
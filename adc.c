@@ -3,8 +3,39 @@
  */
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include "adc.h"
 
+/* State of the current measurement. Conversions are counted down and
+ * summed up by the ADC interrupt. */
+static volatile uint8_t adcremaining = 0;
+static volatile uint16_t adcsum = 0;
+static uint8_t adcextrabits = 0;
+/* Number of conversions to throw away before we start summing up, because
+ * the reference or the bandgap have not settled yet. */
+static volatile uint8_t adcdiscard = 0;
+
+/* How many conversions to throw away after switching the reference.
+ * The capacitor on AREF needs to charge / discharge, and one conversion
+ * takes about 200 us with our prescaler. */
+#define ADC_REFSETTLECONV 5
+/* Same after selecting the bandgap. */
+#define ADC_BANDGAPSETTLECONV 2
+
+ISR(ADC_vect)
+{
+  if (adcdiscard > 0) {
+    adcdiscard--;
+  } else {
+    adcsum += ADC;
+    adcremaining--;
+  }
+  if (adcremaining > 0) { /* Oversampling, we need more conversions */
+    ADCSRA |= _BV(ADSC);
+  }
+}
+
 void adc_init(void)
 {
   /* Select prescaler for ADC, disable autotriggering, turn off ADC */
@@ -25,7 +56,7 @@ void adc_power(uint8_t p)
     PRR0 &= (uint8_t)~_BV(PRADC);
   } else {
     /* Send ADC to sleep */
-    ADCSRA &= (uint8_t)~_BV(ADEN);
+    ADCSRA &= (uint8_t)~(_BV(ADEN) | _BV(ADIE));
     PRR0 |= _BV(PRADC);
   }
 }
@@ -33,11 +64,21 @@ void adc_power(uint8_t p)
 void adc_select(uint8_t pin)
 {
   uint8_t muxval = pin; /* That is correct for pin 0-7 */
-  if (pin > 7) {
+  uint8_t refval = _BV(REFS0); /* AVCC with external cap */
+  if (pin == ADC_BANDGAP) {
+    muxval = 0x1e;
+    adcdiscard = ADC_BANDGAPSETTLECONV;
+  } else if (pin == ADC_TEMPERATURE) {
+    muxval = 0x27;
+    refval = _BV(REFS1) | _BV(REFS0); /* The sensor needs the internal 2.56V reference */
+  } else if (pin > 7) {
     muxval = 0x20 - 8 + pin;
   }
+  if ((ADMUX & 0xc0) != refval) {
+    adcdiscard = ADC_REFSETTLECONV;
+  }
   /* Note: MUX is split over ADMUX (bits 4-0) and ADCSRB (bit 5) */
-  ADMUX = (ADMUX & 0xe0) | (muxval & 0x1f);
+  ADMUX = refval | (muxval & 0x1f);
   if (muxval & 0x20) {
     ADCSRB |= _BV(MUX5);
   } else {
@@ -48,15 +89,75 @@ void adc_select(uint8_t pin)
 /* Start ADC conversion */
 void adc_start(void)
 {
-  ADCSRA |= _BV(ADEN) | _BV(ADSC);
+  adc_startoversampled(0);
+}
+
+void adc_startoversampled(uint8_t extrabits)
+{
+  adcsum = 0;
+  adcextrabits = extrabits;
+  /* 4^extrabits conversions give us extrabits more bits of resolution */
+  adcremaining = 1 << (extrabits * 2);
+  ADCSRA |= _BV(ADEN) | _BV(ADIE) | _BV(ADIF) | _BV(ADSC);
+}
+
+uint8_t adc_isdone(void)
+{
+  return (adcremaining == 0);
 }
 
 uint16_t adc_read(void)
 {
-  /* Wait for ADC */
-  while ((ADCSRA & _BV(ADSC))) { }
-  /* Read result */
-  uint16_t res = ADCL;
-  res |= (ADCH << 8);
-  return res;
+  /* Sleep until the ADC is done. This is plain idle sleep, not the ADC
+   * noise reduction mode: that one stops clkIO and with it Timer3, so our
+   * timebase would lose the conversion time (10+ ms every transmission)
+   * and the geiger buckets would drift. The CPU core, which is the main
+   * source of noise, is halted in idle sleep as well. */
+  cli();
+  while (adcremaining > 0) {
+    /* The instruction after sei() is always executed before any pending
+     * interrupt, so we cannot miss the wakeup here. */
+    sei();
+    sleep_cpu();
+    cli();
+  }
+  sei();
+  /* Decimate: The sum of 4^n samples shifted right by n. */
+  return adcsum >> adcextrabits;
+}
+
+uint16_t adc_readvcc(void)
+{
+  uint16_t bg;
+  adc_select(ADC_BANDGAP);
+  adc_startoversampled(2);
+  bg = adc_read();
+  if (bg == 0) { /* Should never happen, but we don't want to divide by 0 */
+    return 0xffff;
+  }
+  /* bg = 1.1V / VCC * 4096 */
+  return (uint16_t)((1100UL * 4096UL) / bg);
+}
+
+int8_t adc_readtemperature(void)
+{
+  uint16_t v;
+  int16_t t;
+  adc_select(ADC_TEMPERATURE);
+  adc_startoversampled(2);
+  /* 12 bits, i.e. 4 times the 10 bit codes from the datasheet. The typical
+   * ATmega32u4 characteristic is 0x10D at -40C, 0x160 at 25C and 0x1E0 at
+   * 85C: not 1 LSB per degree, and steeper below 25C than above. We
+   * interpolate linearly between these points (and extrapolate beyond).
+   * The offset of the individual chip still varies by several degrees,
+   * see the tempoffset setting. */
+  v = adc_read();
+  if (v < (0x160 << 2)) {
+    t = 25 - (int16_t)((((int32_t)(0x160 << 2) - v) * 65 + (0x53 << 1)) / (0x53 << 2));
+  } else {
+    t = 25 + (int16_t)((((int32_t)v - (0x160 << 2)) * 60 + (0x80 << 1)) / (0x80 << 2));
+  }
+  if (t < -128) t = -128;
+  if (t > 127) t = 127;
+  return (int8_t)t;
 }
@@ -8,7 +8,11 @@
 /* General initialization */
 void adc_init(void);
 
-/* Select a pin */
+/* Select a pin. Besides the pins 0-13, this also accepts the internal
+ * channels below. The right reference voltage is selected automatically,
+ * and conversions after switching are thrown away until it has settled. */
+#define ADC_BANDGAP     0x80 /* internal 1.1V bandgap, measured against AVCC */
+#define ADC_TEMPERATURE 0x81 /* on-die temperature sensor */
 void adc_select(uint8_t pin);
 
 /* Turn ADC on or off */
@@ -17,7 +21,26 @@ void adc_power(uint8_t p);
 /* Start ADC conversion */
 void adc_start(void);
 
-/* Read ADC. Will wait for completion of ADC conversion if necessary. */
+/* Start an oversampled measurement: 4^extrabits conversions are done in the
+ * background and summed up, adc_read() will then return a value with
+ * 10 + extrabits bits. extrabits can be at most 3. */
+void adc_startoversampled(uint8_t extrabits);
+
+/* Check whether the measurement started has finished. */
+uint8_t adc_isdone(void);
+
+/* Read ADC. Will sleep until completion of ADC conversion if necessary.
+ * Interrupts need to be enabled when calling this. */
 uint16_t adc_read(void);
 
+/* Measure our supply voltage (AVCC) by measuring the internal bandgap
+ * against it. Result is in mV, and only as accurate as the bandgap (which
+ * can be off by up to 10%). The ADC needs to be powered. */
+uint16_t adc_readvcc(void);
+
+/* Measure the temperature of the chip in degrees celsius, using the
+ * typical curve from the datasheet. Uncalibrated: add settings.tempoffset
+ * (see eeprom.h) for the individual chip. The ADC needs to be powered. */
+int8_t adc_readtemperature(void);
+
 #endif /* _ADC_H_ */
@@ -0,0 +1,89 @@
+/* $Id: airtime.c $
+ * Airtime (duty cycle) budget, see airtime.h
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "airtime.h"
+#include "clock.h"
+
+/* One hour in slots of 5 minutes. A slot drops out of the sum as a
+ * whole, so the window really is between 55 and 60 minutes long. */
+#define SLOTS 12
+#define SLOTLEN CLOCK_SECONDS(5 * 60)
+
+/* Airtime in ms per slot. The slot number n is stored in slots[n % SLOTS]. */
+static uint16_t slots[SLOTS];
+/* The number of the newest slot (clock_now() / SLOTLEN) */
+static uint32_t lastslot;
+static uint16_t refused = 0;
+
+/* How much of the budget each priority may use, in 1/10 */
+static const uint8_t prioshare[3] PROGMEM = { 5, 9, 10 };
+
+uint16_t airtime_estimate(uint8_t len, uint32_t bps)
+{
+  /* 3 bytes preamble and 2 bytes sync word, rounded up */
+  uint32_t bits = ((uint32_t)len + 5) * 8;
+  return (uint16_t)(((bits * 1000UL) + bps - 1) / bps);
+}
+
+/* Sum of the slots that are less than an hour old at time now */
+static uint32_t sumslots(uint32_t now)
+{
+  uint32_t cur = now / SLOTLEN;
+  uint32_t res = 0;
+  /* Right after boot there are fewer than SLOTS slots yet: lastslot - i
+   * would wrap around and count the same slots again. */
+  for (uint8_t i = 0; (i < SLOTS) && (i <= lastslot); i++) {
+    uint32_t s = lastslot - i;
+    if ((cur - s) < SLOTS) {
+      res += slots[s % SLOTS];
+    }
+  }
+  return res;
+}
+
+uint32_t airtime_used_noirq(void)
+{
+  return sumslots(clock_now_noirq());
+}
+
+uint32_t airtime_used(void)
+{
+  return sumslots(clock_now());
+}
+
+uint8_t airtime_allow(uint8_t prio, uint16_t ms)
+{
+  uint32_t limit = (AIRTIME_BUDGETMS / 10) * pgm_read_byte(&prioshare[prio]);
+  if ((airtime_used() + ms) <= limit) {
+    return 1;
+  }
+  refused++;
+  return 0;
+}
+
+void airtime_add(uint16_t ms)
+{
+  uint32_t cur = clock_now() / SLOTLEN;
+  uint16_t * slot;
+  /* Clear the slots we skipped since the last frame */
+  for (uint8_t i = 0; (i < SLOTS) && (lastslot != cur); i++) {
+    lastslot++;
+    slots[lastslot % SLOTS] = 0;
+  }
+  lastslot = cur;
+  slot = &slots[cur % SLOTS];
+  if ((uint16_t)(*slot + ms) < *slot) { /* Saturate */
+    *slot = 0xffff;
+  } else {
+    *slot += ms;
+  }
+}
+
+uint16_t airtime_getrefused_noirq(void)
+{
+  return refused;
+}
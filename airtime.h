@@ -0,0 +1,37 @@
+/* $Id: airtime.h $
+ * Keeps track of how long we have been transmitting. In the 868.0-868.6
+ * MHz SRD band a device may only transmit 1% of the time, i.e. 36 seconds
+ * per hour. We keep the airtime of the last hour in slots of 5 minutes,
+ * and refuse frames that would exceed the budget. The lower the priority
+ * of a frame, the more of the budget it leaves to the more important
+ * frames.
+ */
+
+#ifndef _AIRTIME_H_
+#define _AIRTIME_H_
+
+/* The budget for one hour in ms */
+#define AIRTIME_BUDGETMS 36000UL
+
+/* Priorities, with the share of the budget that may be used up before
+ * frames of that priority are refused. */
+#define AIRTIME_PRIO_LOW    0 /* extra frames: 50% */
+#define AIRTIME_PRIO_NORMAL 1 /* the regular measurement: 90% */
+#define AIRTIME_PRIO_HIGH   2 /* alarms: 100% */
+
+/* Estimate how long a frame of len bytes will take to send, in ms.
+ * This includes preamble and sync word. */
+uint16_t airtime_estimate(uint8_t len, uint32_t bps);
+/* Is there enough budget left to send a frame of ms at priority prio?
+ * Refusals are counted. */
+uint8_t airtime_allow(uint8_t prio, uint16_t ms);
+/* Record that we have just transmitted for ms. */
+void airtime_add(uint16_t ms);
+/* Airtime used in the last hour in ms. The _noirq variant does not change
+ * anything, so it is safe to call from the console. */
+uint32_t airtime_used(void);
+uint32_t airtime_used_noirq(void);
+/* Number of frames refused since boot. */
+uint16_t airtime_getrefused_noirq(void);
+
+#endif /* _AIRTIME_H_ */
@@ -0,0 +1,200 @@
+/* $Id: clock.c $
+ * Our monotonic time base, see clock.h
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include "clock.h"
+#include "geiger.h"
+#include "sched.h"
+#include "sysmon.h"
+
+/* Timer3 runs with prescaler /1024, i.e. one tick is 128 us, and wraps
+ * every 6 seconds. */
+#define T3TOP (46875 - 1)
+/* Conversion from timer ticks to our time unit: 1/64 s = 15625/128 ticks.
+ * Dividing by that is expensive, so we multiply with 2^22 * 128 / 15625
+ * (rounded up) and shift instead. That can only err up by a small fraction
+ * of a tick, so we never wake up before a deadline. It stays below
+ * CLOCK_PERIOD for the largest possible TCNT3, so time never goes backwards. */
+#define TICKSTOCLOCK(t) ((uint16_t)(((uint32_t)(t) * 34360UL) >> 22))
+#define CLOCKTOTICKS(c) ((uint16_t)(((uint32_t)(c) * 15625UL + 127UL) / 128UL))
+
+/* Our time at the start of the current timer period. Only modified
+ * from the interrupt. */
+static volatile uint32_t periodstart = 0;
+/* When the current geiger bucket ends, and whether compare unit B has
+ * been programmed for that yet. */
+static uint32_t bucketalarm;
+static uint8_t bucketalarmarmed = 1;
+
+/* Program compare unit B for bucketalarm, if it is in the current timer
+ * period. If we are already late, make it fire as soon as possible. */
+static void armbucketalarm_noirq(void)
+{
+  uint32_t rel = bucketalarm - periodstart;
+  uint16_t now = TCNT3;
+  uint16_t ocr;
+  if (CLOCK_HASPASSED(bucketalarm, clock_now_noirq())) {
+    ocr = now + 2;
+  } else if (rel < CLOCK_PERIOD) {
+    ocr = CLOCKTOTICKS(rel);
+    if (ocr <= now) {
+      ocr = now + 2;
+    }
+  } else {
+    return; /* Not in this period, we'll try again after the wrap */
+  }
+  if (ocr > T3TOP) {
+    return; /* Too close to the wrap, we'll try again after it */
+  }
+  OCR3B = ocr;
+  TIFR3 |= _BV(OCF3B);
+  TIMSK3 |= _BV(OCIE3B);
+  bucketalarmarmed = 1;
+}
+
+ISR(TIMER3_CAPT_vect)
+{
+  periodstart += CLOCK_PERIOD;
+  geiger_tick_noirq();
+  if (!bucketalarmarmed) {
+    armbucketalarm_noirq();
+  }
+  sched_timer_noirq();
+}
+
+ISR(TIMER3_COMPB_vect)
+{
+  TIMSK3 &= (uint8_t)~_BV(OCIE3B);
+  bucketalarmarmed = 0;
+  geiger_bucketend_noirq(); /* This sets the next alarm */
+}
+
+ISR(TIMER3_COMPA_vect)
+{
+  /* The next task is due. */
+  sched_timer_noirq();
+}
+
+void clock_init(void)
+{
+  ICR3H = T3TOP >> 8;
+  ICR3L = T3TOP & 0xff;
+  /* Set CTC-mode with the MAX taken from ICR3.
+   * Select prescaler /1024, this results in 46875 timer-ticks in 6 seconds. */
+  TCCR3A = 0x00;
+  TCCR3B = _BV(WGM33) | _BV(WGM32) | _BV(CS32) | _BV(CS30);
+  TIFR3 |= _BV(ICF3) | _BV(OCF3A);
+  TIMSK3 |= _BV(ICIE3);
+}
+
+uint32_t clock_now_noirq(void)
+{
+  uint32_t ps = periodstart;
+  uint16_t t = TCNT3;
+  /* If the timer wrapped but the interrupt has not run yet, we
+   * need to account for that ourselves. */
+  if ((TIFR3 & _BV(ICF3)) && (t < (T3TOP / 2))) {
+    ps += CLOCK_PERIOD;
+  }
+  return ps + TICKSTOCLOCK(t);
+}
+
+uint32_t clock_now(void)
+{
+  uint32_t res;
+  SYSMON_CLI(SYSMON_CS_CLOCKREAD);
+  res = clock_now_noirq();
+  SYSMON_SEI(SYSMON_CS_CLOCKREAD);
+  return res;
+}
+
+uint32_t clock_uptime(void)
+{
+  return clock_now() / CLOCK_HZ;
+}
+
+uint8_t clock_setalarm_noirq(uint32_t when)
+{
+  uint32_t ps = periodstart;
+  uint16_t ocr;
+  if (CLOCK_HASPASSED(when, clock_now_noirq())) {
+    return 1;
+  }
+  if ((when - ps) >= CLOCK_PERIOD) {
+    /* Not in this period: the wrap interrupt will wake us. */
+    TIMSK3 &= (uint8_t)~_BV(OCIE3A);
+    return 0;
+  }
+  ocr = CLOCKTOTICKS(when - ps);
+  OCR3A = ocr;
+  TIFR3 |= _BV(OCF3A);
+  TIMSK3 |= _BV(OCIE3A);
+  if (TCNT3 >= ocr) { /* Too late, it already passed */
+    return 1;
+  }
+  return 0;
+}
+
+/* Reading the 16 bit TCNT3 uses a temporary register that an interrupt
+ * could clobber, so we need to disable interrupts for that. */
+static uint16_t readtcnt3(void)
+{
+  uint16_t res;
+  uint8_t sreg = SREG;
+  cli();
+  res = TCNT3;
+  SREG = sreg;
+  return res;
+}
+
+void clock_setbucketalarm_noirq(uint32_t when)
+{
+  TIMSK3 &= (uint8_t)~_BV(OCIE3B);
+  bucketalarm = when;
+  bucketalarmarmed = 0;
+  armbucketalarm_noirq();
+}
+
+void clock_sleepticks(uint16_t ticks)
+{
+  uint16_t start;
+  uint16_t ocr;
+  cli();
+  start = TCNT3;
+  ocr = start + ticks;
+  if ((ocr > T3TOP) || (ocr < start)) {
+    ocr -= (T3TOP + 1);
+  }
+  OCR3A = ocr;
+  TIFR3 |= _BV(OCF3A);
+  TIMSK3 |= _BV(OCIE3A);
+  sei();
+  while (clock_ticksince(start) < ticks) {
+    cli();
+    /* Time might have run out before we got here: don't sleep then, the
+     * compare match has already been and gone. */
+    if (clock_ticksince(start) < ticks) {
+      sei();
+      sleep_cpu();
+    }
+    sei();
+  }
+}
+
+uint16_t clock_getticks(void)
+{
+  return readtcnt3();
+}
+
+uint16_t clock_ticksince(uint16_t start)
+{
+  uint16_t end = readtcnt3();
+  if (end >= start) {
+    return end - start;
+  }
+  /* Timer wrapped */
+  return end + (T3TOP + 1) - start;
+}
@@ -0,0 +1,56 @@
+/* $Id: clock.h $
+ * Our monotonic time base: Timer3 plus a software extension in its
+ * overflow interrupt. Time is counted in 1/64 seconds since boot as a
+ * 32 bit value, which lasts for about 2 years before it wraps.
+ */
+
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#define CLOCK_HZ 64
+#define CLOCK_SECONDS(s) ((uint32_t)(s) * CLOCK_HZ)
+/* Timer3 wraps every 6 seconds (this also is one geiger "tick"). */
+#define CLOCK_PERIOD CLOCK_SECONDS(6)
+
+/* Comparing timestamps: Always use these (or compare differences), never
+ * compare two timestamps directly - then wrapping is not a problem as long
+ * as the two are less than a year apart. */
+#define CLOCK_DIFF(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)))
+#define CLOCK_ISBEFORE(a, b) (CLOCK_DIFF((a), (b)) < 0)
+#define CLOCK_HASPASSED(t, now) (CLOCK_DIFF((now), (t)) >= 0)
+
+/* General initialization. Takes over Timer3. */
+void clock_init(void);
+
+/* The current time. */
+uint32_t clock_now(void);
+/* Same, but may only be called with interrupts disabled, e.g. from
+ * an interrupt. */
+uint32_t clock_now_noirq(void);
+/* Seconds since boot */
+uint32_t clock_uptime(void);
+
+/* Program the Timer3 compare unit to wake us at time when. This only
+ * works for times within the current timer period, otherwise the
+ * next overflow interrupt will wake us anyways. Returns 1 if when has
+ * already passed. Must be called with interrupts disabled. */
+uint8_t clock_setalarm_noirq(uint32_t when);
+
+/* Have geiger_bucketend_noirq() called at time when. This uses the
+ * second compare unit of Timer3, so the buckets end exactly on time and
+ * do not depend on how quickly the main loop reacts.
+ * Must be called with interrupts disabled. */
+void clock_setbucketalarm_noirq(uint32_t when);
+
+/* Sleep (idle) for ticks timer ticks (128 us, less than 6 seconds). Any
+ * interrupt wakes the CPU on the way, but we only return when the time is
+ * up. This borrows compare unit A from the scheduler, which programs it
+ * again after every task - so only call it from a task. */
+void clock_sleepticks(uint16_t ticks);
+
+/* Raw timer ticks (128 us) for measuring short durations. */
+uint16_t clock_getticks(void);
+/* Number of timer ticks elapsed since start (max. 6 seconds). */
+uint16_t clock_ticksince(uint16_t start);
+
+#endif /* _CLOCK_H_ */
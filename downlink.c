@@ -0,0 +1,95 @@
+/* $Id: downlink.c $
+ * Authenticated configuration commands, see downlink.h
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "downlink.h"
+
+/* Word i of the key, MSB first */
+static uint32_t keyword(const uint8_t * key, uint8_t i)
+{
+  return ((uint32_t)key[i * 4] << 24) | ((uint32_t)key[i * 4 + 1] << 16)
+       | ((uint32_t)key[i * 4 + 2] << 8) | (uint32_t)key[i * 4 + 3];
+}
+
+/* Encrypt one 64 bit block with XTEA (32 cycles). XTEA is tiny in both
+ * flash and RAM, which is why we use it. */
+static void xtea(const uint8_t * key, uint32_t * v)
+{
+  uint32_t v0 = v[0];
+  uint32_t v1 = v[1];
+  uint32_t sum = 0;
+  for (uint8_t i = 0; i < 32; i++) {
+    v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + keyword(key, sum & 3));
+    sum += 0x9E3779B9UL;
+    v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + keyword(key, (sum >> 11) & 3));
+  }
+  v[0] = v0;
+  v[1] = v1;
+}
+
+/* CBC-MAC over the first DOWNLINK_MACOFS bytes of pkt. That is secure
+ * because all packets have the same length. */
+static void downlink_mac(const uint8_t * key, const uint8_t * pkt, uint8_t * mac)
+{
+  uint8_t buf[16];
+  uint32_t v[2] = { 0, 0 };
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, pkt, DOWNLINK_MACOFS);
+  for (uint8_t b = 0; b < sizeof(buf); b += 8) {
+    v[0] ^= ((uint32_t)buf[b] << 24) | ((uint32_t)buf[b + 1] << 16)
+          | ((uint32_t)buf[b + 2] << 8) | (uint32_t)buf[b + 3];
+    v[1] ^= ((uint32_t)buf[b + 4] << 24) | ((uint32_t)buf[b + 5] << 16)
+          | ((uint32_t)buf[b + 6] << 8) | (uint32_t)buf[b + 7];
+    xtea(key, v);
+  }
+  for (uint8_t i = 0; i < DOWNLINK_MACLEN; i++) {
+    mac[i] = (v[0] >> (24 - (i * 8))) & 0xff;
+  }
+}
+
+void downlink_build(const uint8_t * key, uint8_t id, const struct downlinkcmd * c, uint8_t * pkt)
+{
+  pkt[0] = DOWNLINK_TYPE;
+  pkt[1] = id;
+  pkt[2] = (c->counter >> 24) & 0xff;
+  pkt[3] = (c->counter >> 16) & 0xff;
+  pkt[4] = (c->counter >>  8) & 0xff;
+  pkt[5] = (c->counter >>  0) & 0xff;
+  pkt[6] = c->cmd;
+  pkt[7] = (c->value >> 24) & 0xff;
+  pkt[8] = (c->value >> 16) & 0xff;
+  pkt[9] = (c->value >>  8) & 0xff;
+  pkt[10] = (c->value >>  0) & 0xff;
+  downlink_mac(key, pkt, &pkt[DOWNLINK_MACOFS]);
+  pkt[15] = 0;
+}
+
+uint8_t downlink_parse(const uint8_t * key, uint8_t id, uint32_t lastcounter,
+                       const uint8_t * pkt, struct downlinkcmd * c)
+{
+  uint8_t mac[DOWNLINK_MACLEN];
+  uint8_t diff = 0;
+  uint32_t counter;
+  if ((pkt[0] != DOWNLINK_TYPE) || (pkt[1] != id)) {
+    return 0;
+  }
+  counter = ((uint32_t)pkt[2] << 24) | ((uint32_t)pkt[3] << 16)
+          | ((uint32_t)pkt[4] << 8) | (uint32_t)pkt[5];
+  if (counter <= lastcounter) { /* Old or replayed */
+    return 0;
+  }
+  downlink_mac(key, pkt, mac);
+  for (uint8_t i = 0; i < DOWNLINK_MACLEN; i++) {
+    diff |= mac[i] ^ pkt[DOWNLINK_MACOFS + i];
+  }
+  if (diff != 0) {
+    return 0;
+  }
+  c->counter = counter;
+  c->cmd = pkt[6];
+  c->value = ((uint32_t)pkt[7] << 24) | ((uint32_t)pkt[8] << 16)
+           | ((uint32_t)pkt[9] << 8) | (uint32_t)pkt[10];
+  return 1;
+}
@@ -0,0 +1,55 @@
+/* $Id: downlink.h $
+ * Authenticated configuration commands that we receive over the air, in
+ * the short receive window after a transmission (see main.c).
+ * Nothing in here is AVR specific, so tools/fgdownlink.c uses the same
+ * code to build the packets on the host.
+ */
+
+#ifndef _DOWNLINK_H_
+#define _DOWNLINK_H_
+
+#include <stdint.h>
+
+/* The packets have a fixed length:
+ * Byte  0: DOWNLINK_TYPE
+ * Byte  1: Sensor-ID of the receiver
+ * Byte  2-5: Counter, MSB first. It must be higher than the counter of the
+ *            last command that was accepted, so recorded packets cannot be
+ *            replayed.
+ * Byte  6: Command, see below
+ * Byte  7-10: Value, MSB first
+ * Byte 11-14: MAC: the first 4 bytes of an XTEA CBC-MAC over bytes 0-10
+ *             (padded with zeros to 16 bytes), with the 128 bit key
+ * Byte 15: 0
+ */
+#define DOWNLINK_LEN     16
+#define DOWNLINK_TYPE    0xd5
+#define DOWNLINK_MACOFS  11
+#define DOWNLINK_MACLEN  4
+#define DOWNLINK_KEYLEN  16
+
+/* The commands. Each one sets the setting of the same name, except for
+ * HISTUPLOAD, which uploads the history right away (value is ignored). */
+#define DOWNLINK_CMD_TXINTERVAL 0x01
+#define DOWNLINK_CMD_RFMPOWER   0x02
+#define DOWNLINK_CMD_TXFORMAT   0x03
+#define DOWNLINK_CMD_TXAVG      0x04
+#define DOWNLINK_CMD_ALARMCPM   0x05
+#define DOWNLINK_CMD_RXEVERY    0x06
+#define DOWNLINK_CMD_HISTUPLOAD 0x07
+
+struct downlinkcmd {
+  uint32_t counter;
+  uint8_t cmd;
+  uint32_t value;
+};
+
+/* Fill in pkt (DOWNLINK_LEN bytes) with command c for sensor id. */
+void downlink_build(const uint8_t * key, uint8_t id, const struct downlinkcmd * c, uint8_t * pkt);
+
+/* Check whether pkt is a valid command for sensor id, with a counter
+ * higher than lastcounter. If it is, fill in c and return 1. */
+uint8_t downlink_parse(const uint8_t * key, uint8_t id, uint32_t lastcounter,
+                       const uint8_t * pkt, struct downlinkcmd * c);
+
+#endif /* _DOWNLINK_H_ */
@@ -13,3 +13,19 @@
 EEMEM uint8_t ee_sensorid = THESENSORID;
 EEMEM uint8_t ee_invsensorid = THESENSORID ^ 0xff;
 
+/* The runtime settings. These are only written through the console.
+ * They are deliberately left all 0 (i.e. an invalid version) here, so that
+ * the firmware defaults are used until something has been set. */
+EEMEM struct settings ee_settings;
+
+/* The key for the downlink commands, 16 bytes. Leave this at all 0xff to
+ * disable the downlink. Put the same key into tools/fgdownlink. */
+EEMEM uint8_t ee_downlinkkey[16] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+EEMEM uint32_t ee_downlinkcounter = 0;
+
+/* The journal of the geiger counter history. Starts empty (all invalid). */
+EEMEM struct geigerjournalrec ee_geigerjournal[GEIGERJOURNALSIZE];
+EEMEM uint32_t ee_geigerstale = 0xffffffffUL;
@@ -10,4 +10,74 @@
 extern EEMEM uint8_t ee_sensorid;
 extern EEMEM uint8_t ee_invsensorid; /* This is used as a sort of "CRC" */
 
+/* Settings that can be changed at runtime through the console.
+ * Increase SETTINGSVERSION whenever the layout of this changes - settings
+ * with a different version in the EEPROM are ignored, and the defaults
+ * (see main.c) are used instead. */
+#define SETTINGSVERSION 11
+struct settings {
+  uint8_t version;
+  uint8_t txinterval;   /* Transmit interval in ticks of 6 seconds */
+  uint32_t rfmfreq;     /* RFM69 frequency in kHz */
+  uint32_t rfmdatarate; /* RFM69 datarate in bit/s */
+  uint8_t rfmpower;     /* RFM69 output power, 0-31 (31 = 13 dBm) */
+  uint16_t avgwinshort; /* The short average window, in seconds */
+  uint16_t avgwinlong;  /* The long average window, in seconds */
+  uint32_t alarmcpm;    /* Transmit immediately when the short average reaches this. 0 = off */
+  uint32_t bucketms;    /* Length of a geiger bucket in ms, see geiger.h */
+  uint8_t txavg;        /* Which averages to send: 0 = windowed, 1 = the
+                         * moving averages (1 and 60 min) instead, 2 = both,
+                         * the moving averages in a second frame. */
+  uint16_t viuncert;    /* Variable integration time measurement (see geiger.h):
+                         * target uncertainty in 0.1%, 0 = off */
+  uint16_t vimintime;   /* and its minimum */
+  uint16_t vimaxtime;   /* and maximum integration time in seconds */
+  uint8_t txformat;     /* 0 = the fixed frames (0xf9 etc.), 1 = the TLV
+                         * frame (0xfa) instead, 2 = both */
+  uint8_t rxevery;      /* Listen for downlink commands after every n-th
+                         * transmission, 0 = never. See downlink.h */
+  uint8_t rxwindow;     /* and for how long, in ms */
+  uint8_t txslot;       /* Transmit timing: 0 = txinterval +-1 tick at random,
+                         * 1 = slotted: txinterval plus an offset from the
+                         * sensor ID, see main.c */
+  uint8_t lbt;          /* Listen before talk: only transmit if the channel
+                         * is weaker than -lbt dBm. 0 = off */
+  uint8_t txauto;       /* 1 = let the RFM69 send on its own (AutoModes),
+                         * so we can go back to sleep right away */
+  uint8_t histupload;   /* Upload the geiger history (frame 0xfd) every
+                         * n hours. 0 = only on request */
+  uint8_t tempoffset;   /* Correction for the chip temperature, in degrees
+                         * plus 128: to calibrate, compare the console
+                         * output with a thermometer after the device has
+                         * been idle for a while, and set 128 + (true -
+                         * shown). 128 = no correction */
+  uint16_t crc;         /* CRC16 over all of the above. Must be the last element! */
+};
+extern EEMEM struct settings ee_settings;
+
+/* The key for the downlink commands (see downlink.h). All 0xff means
+ * that no key has been set, and we never listen for commands. */
+extern EEMEM uint8_t ee_downlinkkey[16];
+/* The counter of the last downlink command we accepted. */
+extern EEMEM uint32_t ee_downlinkcounter;
+
+/* Journal of the geiger counter history, so it survives resets and power
+ * loss. This is a ring: Every finished bucket is written to the next
+ * record. ts is the number of the bucket, and serves as a timestamp
+ * that tells us which records belong together. crc is a CRC8 over the
+ * bucket length, ts and value. With one record every 30 seconds, each
+ * record gets rewritten every 90 minutes, so the EEPROM should last for
+ * well over a decade. Buckets shorter than 15 seconds are not journalled. */
+#define GEIGERJOURNALSIZE 180
+struct geigerjournalrec {
+  uint16_t ts;
+  uint16_t value;
+  uint8_t crc;
+};
+extern EEMEM struct geigerjournalrec ee_geigerjournal[GEIGERJOURNALSIZE];
+/* The number of the newest bucket in the journal from before we last lost
+ * our supply (low 16 bits, its inverse in the high ones, all 0xff = none).
+ * Those are stale, see geiger_init(). */
+extern EEMEM uint32_t ee_geigerstale;
+
 #endif /* _EEPROM_H_ */
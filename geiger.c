@@ -3,122 +3,1112 @@
  */
 
 #include <avr/io.h>
+#include <stddef.h>
 #include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <math.h>
+#include <util/crc16.h>
+#include "clock.h"
+#include "eeprom.h"
 #include "geiger.h"
+#include "sysmon.h"
 #include "lufa/console.h"
 
-static uint8_t t3ovfcnt = 0;
-static uint16_t currentgeigcount = 0;
-static volatile uint16_t ticks = 0;
+/* The following variables survive a warm restart (watchdog or reset
+ * button): They are in the .noinit section, so they are not cleared on
+ * boot. They are protected by a magic value and a checksum (the sum of all
+ * of them) that is kept up to date with every change, so we can tell
+ * whether what's in RAM after a reset is still valid. */
+#define NOINITMAGIC 0xf0c6
+/* The length of a bucket in clock.h units. */
+static uint16_t bucketlen __attribute__((section(".noinit")));
+/* How long the current bucket has been running, in clock periods (6 s).
+ * We need this to continue the bucket after a warm restart. */
+static uint8_t bucketage __attribute__((section(".noinit")));
+/* Everything that exists once per counter (see GEIGER_NUMCOUNTERS) is kept
+ * in arrays indexed by the counter, so the code handling one counter is
+ * the same for all of them. */
+static uint16_t currentgeigcount[GEIGER_NUMCOUNTERS] __attribute__((section(".noinit")));
+/* The history of buckets, packed into HISTBITS bits per bucket. The
+ * buckets are grouped into blocks of GEIGERHISTBLOCK that share an
+ * exponent (block floating point): a bucket holds its count shifted right
+ * by the exponent of its block and rounded, 0-HISTMAXMANT, or HISTINVALID
+ * for no data. The exponent is only raised (and the other buckets of the
+ * block rescaled) when a count does not fit. So counts up to HISTMAXMANT,
+ * i.e. background radiation, are exact, unless they share a block with a
+ * bigger one - and even then they are off by at most 6% of that.
+ * When the history wraps around into a block, the whole block is cleared,
+ * so the oldest GEIGERHISTBLOCK - 1 buckets may already be gone.
+ * The rounding would also go into the averages, so we keep two exact
+ * things on the side: the sum of every block (0xffff if it does not fit),
+ * and the last HISTRECENT counts in a ring. Then the windowed averages
+ * (getavg_noirq()) only have to round at most half of the oldest block of
+ * the window, i.e. they are exact for windows within the ring or ending
+ * on a block boundary, and otherwise off by less than GEIGERHISTBLOCK / 2
+ * steps of that block's exponent. The journal and the newest buckets of
+ * the upload come from the ring, so they are exact too. */
+#define HISTBITS      5
+#define HISTMASK      0x1f
+#define HISTMAXMANT   30
+#define HISTINVALID   31
+#define HISTBYTES     ((SIZEOFGEIGERHISTORY * HISTBITS + 7) / 8)
+#define HISTBLOCKS    (SIZEOFGEIGERHISTORY / GEIGERHISTBLOCK)
+static uint8_t histvals[GEIGER_NUMCOUNTERS][HISTBYTES] __attribute__((section(".noinit")));
+/* The exponents, one nibble per block */
+static uint8_t histexp[GEIGER_NUMCOUNTERS][(HISTBLOCKS + 1) / 2] __attribute__((section(".noinit")));
+static uint16_t histblocksum[GEIGER_NUMCOUNTERS][HISTBLOCKS] __attribute__((section(".noinit")));
+/* Two blocks, so the ring always holds the last block that is complete */
+#define HISTRECENT    (2 * GEIGERHISTBLOCK)
+static uint16_t histrecent[GEIGER_NUMCOUNTERS][HISTRECENT] __attribute__((section(".noinit")));
+static uint8_t recentpos __attribute__((section(".noinit")));
+static uint16_t historypos __attribute__((section(".noinit")));
+/* For buckets shorter than a minute, the buckets are also summed up per
+ * minute, so we can still calculate a 60 minute average when the history
+ * of buckets does not cover an hour. 0xffff = invalid. */
+static uint16_t minutevals[GEIGER_NUMCOUNTERS][GEIGERMINUTES] __attribute__((section(".noinit")));
+static uint8_t minutepos __attribute__((section(".noinit")));
+static uint16_t minuteacc[GEIGER_NUMCOUNTERS] __attribute__((section(".noinit")));
+static uint16_t minutebuckets __attribute__((section(".noinit")));
+/* Number of the last finished bucket. Continues from the journal. */
+static volatile uint16_t bucketcount __attribute__((section(".noinit")));
+/* Number of the last bucket written to the journal, and where to write
+ * the next one. */
+static uint16_t journalledcount __attribute__((section(".noinit")));
+static uint8_t journalslot __attribute__((section(".noinit")));
+/* Buckets up to number stalebucket were restored from before we lost our
+ * supply, if havestale is set. See geiger_init(). */
+static uint16_t stalebucket __attribute__((section(".noinit")));
+static uint8_t havestale __attribute__((section(".noinit")));
+static uint16_t noinitmagic __attribute__((section(".noinit")));
+static uint16_t noinitsum __attribute__((section(".noinit")));
+/* Buckets shorter than this are not written to the journal. With 15 s,
+ * each journal record gets rewritten every 45 minutes, so the EEPROM
+ * should still last for about a decade. */
+#define GEIGERMINJOURNALLEN CLOCK_SECONDS(15)
+/* When the last bucket was finished and the next one ends (clock.h time) */
+static uint32_t lastbuckettime = 0;
+static uint32_t nextbucketend = 0;
+/* CLOCK_SECONDS(60) / bucketlen, or 0 if the buckets are a minute or longer */
+static uint16_t bucketsperminute;
 
-uint16_t geiger_valuehistory[SIZEOFGEIGERHISTORY];
-uint8_t geiger_historypos = 0;
+/* Exponentially weighted moving averages. Their time constants in seconds: */
+static const uint16_t ewmatau[GEIGER_NUMEWMA] PROGMEM = { 60, 10 * 60, 60 * 60 };
+/* The averages, in counts per update (see ewmaupdlen), 16.16 fixed point */
+static uint32_t ewmaval[GEIGER_NUMCOUNTERS][GEIGER_NUMEWMA];
+/* The smoothing factor alpha, 0.32 fixed point */
+static uint32_t ewmaalpha[GEIGER_NUMEWMA];
+/* How often they are updated (clock.h units): Every bucket, but the long
+ * ones are updated from the minute sums if the buckets are short - an
+ * alpha that small would need a lot more bits. */
+static uint16_t ewmaupdlen[GEIGER_NUMEWMA];
+static uint8_t ewmaperminute; /* bitmask */
+/* Multiply an average in counts per minute with this to get its variance */
+static float ewmavarfactor[GEIGER_NUMEWMA];
+/* Bitmask, which of them have a value yet */
+static uint8_t ewmavalid[GEIGER_NUMCOUNTERS];
+/* How many buckets we restored from the journal on boot, and how many of
+ * those were stale. */
+static uint8_t restoredbuckets = 0;
+static uint8_t restoredstale = 0;
 
-ISR(TIMER3_CAPT_vect)
+/* Sum of all finished buckets since boot. Together with currentgeigcount
+ * that gives a running total, without any extra work in the ISRs. */
+static uint32_t totalcount[GEIGER_NUMCOUNTERS];
+
+#if (GEIGER_NUMCHANNELS > 1)
+/* When the last pulse arrived on each tube, as TCNT3 value. This is only
+ * valid within one Timer3 period, at the end of each period it is reset
+ * to NOPULSE, which is far enough from any TCNT3 value to never look like
+ * a coincidence. */
+#define NOPULSE 0xc000
+static uint16_t lastpulse[GEIGER_NUMCHANNELS];
+#endif /* GEIGER_NUMCHANNELS > 1 */
+/* The low byte of TCNT3 at every pulse (128 us resolution), mixed
+ * together. Radioactive decay is as random as it gets. */
+static volatile uint8_t pulseentropy;
+
+/* Variable integration time measurement (only for the first tube): We count until we have vitarget
+ * counts (and so a relative uncertainty of 1/sqrt(vitarget)), but at least
+ * for vimintime and at most for vimaxtime. Times in clock.h units. */
+static uint32_t vitarget = 0; /* 0 = off */
+static uint32_t vimintime;
+static uint32_t vimaxtime;
+static uint16_t viuncert; /* what vitarget was calculated from */
+static uint32_t vistart;
+static uint32_t vistartcount;
+static struct geigerviresult viresult;
+static uint8_t vihaveresult = 0;
+
+/* The packed value of bucket pos of counter ch. A bucket may straddle
+ * two bytes, the lower bits are in the first one. */
+static uint8_t histgetmant(uint8_t ch, uint16_t pos)
 {
-  t3ovfcnt++;
-  ticks++;
-  if (t3ovfcnt == 5) {
-    /* console_printpgm_noirq_P(PSTR(" !30s! ")); */
-    /* 30 seconds have passed, record current value. */
-    geiger_valuehistory[geiger_historypos] = currentgeigcount;
-    currentgeigcount = 0;
-    geiger_historypos++;
-    if (geiger_historypos >= SIZEOFGEIGERHISTORY) { geiger_historypos = 0; }
-    t3ovfcnt = 0;
+  uint16_t bit = pos * HISTBITS;
+  const uint8_t * p = &histvals[ch][bit >> 3];
+  uint8_t shift = bit & 7;
+  uint16_t w = p[0];
+  if (shift > (8 - HISTBITS)) {
+    w |= (uint16_t)p[1] << 8;
   }
+  return (w >> shift) & HISTMASK;
 }
 
-/* This is where the interrupts from the geiger counter end up:
- * It's connected to PD0 / SCL / INT0 */
-ISR(INT0_vect)
+/* Set the packed value of bucket pos of counter ch. This keeps noinitsum
+ * up to date, like all the functions below that modify the history. They
+ * must be called with interrupts disabled (or before they are enabled). */
+static void histsetmant_noirq(uint8_t ch, uint16_t pos, uint8_t m)
+{
+  uint16_t bit = pos * HISTBITS;
+  uint8_t * p = &histvals[ch][bit >> 3];
+  uint8_t shift = bit & 7;
+  uint8_t two = (shift > (8 - HISTBITS));
+  uint16_t w = p[0];
+  if (two) {
+    w |= (uint16_t)p[1] << 8;
+  }
+  noinitsum -= (w & 0xff) + (w >> 8);
+  w = (w & ~((uint16_t)HISTMASK << shift)) | ((uint16_t)m << shift);
+  noinitsum += (w & 0xff) + (w >> 8);
+  p[0] = w & 0xff;
+  if (two) {
+    p[1] = w >> 8;
+  }
+}
+
+static uint8_t histgetexp(uint8_t ch, uint16_t block)
+{
+  uint8_t b = histexp[ch][block >> 1];
+  return (block & 1) ? (b >> 4) : (b & 0x0f);
+}
+
+static void histsetexp_noirq(uint8_t ch, uint16_t block, uint8_t e)
+{
+  uint8_t * p = &histexp[ch][block >> 1];
+  uint8_t b = (block & 1) ? ((*p & 0x0f) | (e << 4)) : ((*p & 0xf0) | e);
+  noinitsum += b - *p;
+  *p = b;
+}
+
+/* Mark all buckets of a block as invalid, so it can be reused. */
+static void histclearblock_noirq(uint8_t ch, uint16_t block)
+{
+  uint16_t pos = block * GEIGERHISTBLOCK;
+  for (uint8_t i = 0; i < GEIGERHISTBLOCK; i++) {
+    histsetmant_noirq(ch, pos + i, HISTINVALID);
+  }
+  histsetexp_noirq(ch, block, 0);
+  noinitsum -= histblocksum[ch][block];
+  histblocksum[ch][block] = 0;
+}
+
+/* value shifted right by e, rounded */
+static uint32_t histshift(uint32_t value, uint8_t e)
+{
+  return (e == 0) ? value : ((value + ((uint32_t)1 << (e - 1))) >> e);
+}
+
+/* Store value in the history of counter ch at pos. */
+static void histstore_noirq(uint8_t ch, uint16_t pos, uint16_t value)
+{
+  uint16_t block = pos / GEIGERHISTBLOCK;
+  uint8_t e = histgetexp(ch, block);
+  uint8_t newe = e;
+  uint16_t sum = histblocksum[ch][block];
+  if (value == 0xffff) {
+    histsetmant_noirq(ch, pos, HISTINVALID);
+    return;
+  }
+  if (sum != 0xffff) {
+    sum = (sum > (0xfffe - value)) ? 0xffff : (sum + value);
+    noinitsum += sum - histblocksum[ch][block];
+    histblocksum[ch][block] = sum;
+  }
+  while (histshift(value, newe) > HISTMAXMANT) {
+    newe++;
+  }
+  if (newe != e) { /* Rescale the rest of the block */
+    uint16_t first = block * GEIGERHISTBLOCK;
+    for (uint16_t i = first; i < (first + GEIGERHISTBLOCK); i++) {
+      uint8_t m = histgetmant(ch, i);
+      if (m != HISTINVALID) {
+        histsetmant_noirq(ch, i, histshift(m, newe - e));
+      }
+    }
+    histsetexp_noirq(ch, block, newe);
+  }
+  histsetmant_noirq(ch, pos, histshift(value, newe));
+}
+
+/* Read the value at pos from the history of counter ch, 0xffff if it is
+ * invalid. Must be called with interrupts disabled, unless the bucket is
+ * finished. */
+static uint16_t histread(uint8_t ch, uint16_t pos)
+{
+  uint8_t m = histgetmant(ch, pos);
+  uint32_t v;
+  if (m == HISTINVALID) {
+    return 0xffff;
+  }
+  v = (uint32_t)m << histgetexp(ch, pos / GEIGERHISTBLOCK);
+  return (v > 0xfffe) ? 0xfffe : v;
+}
+
+/* Same, for the bucket at pos that is age buckets older than the newest
+ * one: exact if it is still in the ring of recent counts. */
+static uint16_t histvalue_noirq(uint8_t ch, uint16_t pos, uint16_t age)
+{
+  if (age < HISTRECENT) {
+    uint16_t v = histrecent[ch][(recentpos + HISTRECENT - 1 - age) % HISTRECENT];
+    if (v != 0xffff) { /* else the ring does not know it, e.g. after a restore */
+      return v;
+    }
+  }
+  return histread(ch, pos);
+}
+
+/* d * a, with a in 0.32 fixed point, rounded. Only uses 32 bit math. */
+static uint32_t mulq32(uint32_t d, uint32_t a)
+{
+  uint16_t dh = d >> 16;
+  uint16_t dl = d & 0xffff;
+  uint16_t ah = a >> 16;
+  uint16_t al = a & 0xffff;
+  uint32_t mid = (((uint32_t)dh * al) >> 1) + (((uint32_t)dl * ah) >> 1) + 0x4000UL;
+  return ((uint32_t)dh * ah) + (mid >> 15);
+}
+
+/* Feed count into the moving average which of counter ch. This is O(1). */
+static void ewmaupdate_noirq(uint8_t ch, uint8_t which, uint16_t count)
+{
+  uint32_t x = (uint32_t)count << 16;
+  uint32_t e = ewmaval[ch][which];
+  if (!(ewmavalid[ch] & _BV(which))) { /* The first value */
+    e = x;
+    ewmavalid[ch] |= _BV(which);
+  } else if (x >= e) {
+    e += mulq32(x - e, ewmaalpha[which]);
+  } else {
+    e -= mulq32(e - x, ewmaalpha[which]);
+  }
+  ewmaval[ch][which] = e;
+}
+
+/* Called from the Timer3 interrupt in clock.c every 6 seconds. */
+void geiger_tick_noirq(void)
+{
+  if (bucketage < 0xff) {
+    bucketage++;
+    noinitsum++;
+  }
+#if (GEIGER_NUMCHANNELS > 1)
+  /* TCNT3 starts over, so the pulse times are meaningless now. We miss
+   * the coincidences that straddle this, but that is only a few hundred
+   * microseconds every 6 seconds. */
+  for (uint8_t i = 0; i < GEIGER_NUMCHANNELS; i++) {
+    lastpulse[i] = NOPULSE;
+  }
+#endif /* GEIGER_NUMCHANNELS > 1 */
+}
+
+/* Called from the Timer3 compare interrupt in clock.c when a bucket
+ * has ended: record the current values of all counters. */
+void geiger_bucketend_noirq(void)
+{
+  uint8_t minutedone = 0;
+  nextbucketend += bucketlen;
+  clock_setbucketalarm_noirq(nextbucketend);
+  lastbuckettime = clock_now_noirq();
+  noinitsum -= historypos + bucketage;
+  if (bucketsperminute > 0) { /* The buckets are also summed up per minute */
+    noinitsum -= minutebuckets + minutepos;
+    minutebuckets++;
+    minutedone = (minutebuckets >= bucketsperminute);
+  }
+  for (uint8_t ch = 0; ch < GEIGER_NUMCOUNTERS; ch++) {
+    uint16_t c = currentgeigcount[ch];
+    noinitsum -= c;
+    if ((historypos % GEIGERHISTBLOCK) == 0) { /* Reuse the oldest block */
+      histclearblock_noirq(ch, historypos / GEIGERHISTBLOCK);
+    }
+    histstore_noirq(ch, historypos, c);
+    noinitsum += c - histrecent[ch][recentpos];
+    histrecent[ch][recentpos] = c;
+    totalcount[ch] += c;
+    currentgeigcount[ch] = 0;
+    for (uint8_t i = 0; i < GEIGER_NUMEWMA; i++) {
+      if (!(ewmaperminute & _BV(i))) {
+        ewmaupdate_noirq(ch, i, c);
+      }
+    }
+    if (bucketsperminute > 0) {
+      uint16_t acc = minuteacc[ch];
+      noinitsum -= acc;
+      acc = (acc > (0xfffe - c)) ? 0xfffe : (acc + c);
+      if (minutedone) {
+        for (uint8_t i = 0; i < GEIGER_NUMEWMA; i++) {
+          if (ewmaperminute & _BV(i)) {
+            ewmaupdate_noirq(ch, i, acc);
+          }
+        }
+        noinitsum += acc - minutevals[ch][minutepos];
+        minutevals[ch][minutepos] = acc;
+        acc = 0;
+      }
+      minuteacc[ch] = acc;
+      noinitsum += acc;
+    }
+  }
+  if (bucketsperminute > 0) {
+    if (minutedone) {
+      minutepos = (minutepos + 1) % GEIGERMINUTES;
+      minutebuckets = 0;
+    }
+    noinitsum += minutebuckets + minutepos;
+  }
+  bucketage = 0;
+  noinitsum -= recentpos;
+  recentpos = (recentpos + 1) % HISTRECENT;
+  noinitsum += recentpos;
+  historypos++;
+  if (historypos >= SIZEOFGEIGERHISTORY) { historypos = 0; }
+  bucketcount++;
+  noinitsum += historypos + 1;
+  if (havestale && ((uint16_t)(bucketcount - stalebucket) >= SIZEOFGEIGERHISTORY)) {
+    havestale = 0; /* They have all left the history */
+    noinitsum--;
+  }
+}
+
+/* Is bucket number bucket one of the stale ones? */
+static uint8_t isstale(uint16_t bucket)
+{
+  return havestale && ((uint16_t)(stalebucket - bucket) < SIZEOFGEIGERHISTORY);
+}
+
+/* Count a pulse on tube ch. This gets inlined into the ISRs below, so ch
+ * is a constant there. */
+static inline void countpulse(uint8_t ch) __attribute__((always_inline));
+static inline void countpulse(uint8_t ch)
 {
   /* 0xffff is a special value meaning 'invalid', so we make sure to never count to that. */
-  if (currentgeigcount < 0xfffe) {
-    currentgeigcount++;
+  if (currentgeigcount[ch] < 0xfffe) {
+    currentgeigcount[ch]++;
+    noinitsum++;
+  }
+  pulseentropy = ((pulseentropy << 1) | (pulseentropy >> 7)) ^ TCNT3L;
+#if (GEIGER_NUMCHANNELS > 1)
+  /* Was there a pulse on any other tube just before this one? The later
+   * pulse of the two counts the coincidence, so each is only counted once. */
+  uint16_t now = TCNT3;
+  for (uint8_t i = 0; i < GEIGER_NUMCHANNELS; i++) {
+    if ((i != ch) && ((uint16_t)(now - lastpulse[i]) <= GEIGER_COINCTICKS)) {
+      if (currentgeigcount[GEIGER_COINCCOUNTER] < 0xfffe) {
+        currentgeigcount[GEIGER_COINCCOUNTER]++;
+        noinitsum++;
+      }
+      break;
+    }
+  }
+  lastpulse[ch] = now;
+#endif /* GEIGER_NUMCHANNELS > 1 */
+}
+
+/* This is where the interrupts from the geiger counters end up:
+ * The first one is connected to PD0 / SCL / INT0, the others to
+ * PD1 / SDA / INT1, PD2 / RXD1 / INT2 and PD3 / TXD1 / INT3. */
+ISR(INT0_vect)
+{
+  countpulse(0);
+}
+#if (GEIGER_NUMCHANNELS > 1)
+ISR(INT1_vect)
+{
+  countpulse(1);
+}
+#endif
+#if (GEIGER_NUMCHANNELS > 2)
+ISR(INT2_vect)
+{
+  countpulse(2);
+}
+#endif
+#if (GEIGER_NUMCHANNELS > 3)
+ISR(INT3_vect)
+{
+  countpulse(3);
+}
+#endif
+
+/* Convert count counts in time (clock.h units) into counts per minute. */
+static uint32_t tocpm(uint32_t count, uint32_t time)
+{
+  /* Make sure the multiplication cannot overflow */
+  while (count > 0xfffffUL) {
+    count >>= 1;
+    time >>= 1;
+  }
+  if (time == 0) {
+    return 0xffffff;
   }
+  return (count * CLOCK_SECONDS(60)) / time;
 }
-uint32_t geiger_get1minavg(void)
+
+/* How many of n buckets, starting age buckets back, are not in the ring
+ * of recent counts, i.e. only available rounded. */
+static uint16_t histrounded(uint16_t age, uint16_t n)
+{
+  return ((age + n) <= HISTRECENT) ? 0 : ((age >= HISTRECENT) ? n : (age + n - HISTRECENT));
+}
+
+/* Average over the last nbuckets buckets. We go back block by block:
+ * Where the window covers a block up to its newest bucket, we can take
+ * the exact histblocksum minus the buckets before the window instead of
+ * the buckets in it - whichever needs fewer rounded values. */
+static uint32_t getavg_noirq(uint8_t ch, uint16_t nbuckets)
 {
   uint32_t sum = 0;
-  uint8_t readpos;
-  uint8_t numvalid = 0;
-  cli(); /* to make sure the history does not get modified while we count */
-  readpos = geiger_historypos;
-  for (uint8_t i = 0; i < 2; i++) {
-    if (readpos == 0) {
-      readpos = SIZEOFGEIGERHISTORY - 1;
-    } else {
-      readpos--;
-    }
-    if (geiger_valuehistory[readpos] != 0xffff) {
-      numvalid++;
-      sum += geiger_valuehistory[readpos];
+  uint16_t age = 0;
+  uint16_t numvalid = 0;
+  /* The block that historypos is in has only been written up to it */
+  uint16_t curblock = ((historypos % GEIGERHISTBLOCK) != 0) ? (historypos / GEIGERHISTBLOCK) : HISTBLOCKS;
+  /* For longer windows, require at least half of the buckets to be valid */
+  uint16_t minvalid = (nbuckets > 2) ? ((nbuckets / 2) + 1) : 1;
+  if (nbuckets > SIZEOFGEIGERHISTORY) {
+    nbuckets = SIZEOFGEIGERHISTORY;
+  }
+  if (havestale && (nbuckets > (uint16_t)(bucketcount - stalebucket))) {
+    nbuckets = bucketcount - stalebucket;
+  }
+  while (age < nbuckets) {
+    uint16_t last = (historypos + (2 * SIZEOFGEIGERHISTORY) - 1 - age) % SIZEOFGEIGERHISTORY;
+    uint16_t block = last / GEIGERHISTBLOCK;
+    uint16_t first = block * GEIGERHISTBLOCK;
+    uint16_t n = last - first + 1;
+    uint16_t start;
+    uint32_t in = 0;
+    if (n > (nbuckets - age)) {
+      n = nbuckets - age;
     }
+    start = last + 1 - n;
+    for (uint16_t i = start; i <= last; i++) {
+      uint16_t v = histvalue_noirq(ch, i, age + (last - i));
+      if (v != 0xffff) {
+        numvalid++;
+        in += v;
+      }
+    }
+    /* Only the newest part of curblock is in its sum, and that came first */
+    if ((histblocksum[ch][block] != 0xffff) && ((age == 0) || (block != curblock))
+     && (histrounded(age + n, start - first) < histrounded(age, n))) {
+      uint32_t out = 0;
+      for (uint16_t i = first; i < start; i++) {
+        uint16_t v = histvalue_noirq(ch, i, age + (last - i));
+        if (v != 0xffff) {
+          out += v;
+        }
+      }
+      /* The rounded values might add up to more than the sum */
+      in = (out < histblocksum[ch][block]) ? (histblocksum[ch][block] - out) : 0;
+    }
+    sum += in;
+    age += n;
   }
-  sei();
-  if (numvalid > 0) {
-    return (sum * 2 / numvalid); /* We return the 1 min avg, not the 30s avg! */
+  if ((numvalid > 0) && (numvalid >= minvalid)) {
+    return tocpm(sum, (uint32_t)numvalid * bucketlen); /* We return counts per minute, not per bucket! */
   } else {
     return 0xffffff;
   }
 }
 
-uint32_t geiger_get60minavg(void)
+uint32_t geiger_getavg(uint8_t ch, uint16_t nbuckets)
+{
+  uint32_t res;
+  SYSMON_CLI(SYSMON_CS_GEIGERAVG); /* to make sure the history does not get modified while we count */
+  res = getavg_noirq(ch, nbuckets);
+  SYSMON_SEI(SYSMON_CS_GEIGERAVG);
+  return res;
+}
+
+static uint32_t getminuteavg_noirq(uint8_t ch, uint8_t nminutes)
 {
   uint32_t sum = 0;
   uint8_t readpos;
   uint8_t numvalid = 0;
-  cli(); /* to make sure the history does not get modified while we count */
-  readpos = geiger_historypos;
-  for (uint8_t i = 0; i < (2 * 60); i++) {
-    if (readpos == 0) {
-      readpos = SIZEOFGEIGERHISTORY - 1;
-    } else {
-      readpos--;
-    }
-    if (geiger_valuehistory[readpos] != 0xffff) {
+  uint8_t minvalid = (nminutes > 2) ? ((nminutes / 2) + 1) : 1;
+  if (nminutes > GEIGERMINUTES) {
+    nminutes = GEIGERMINUTES;
+  }
+  readpos = minutepos;
+  for (uint8_t i = 0; i < nminutes; i++) {
+    readpos = (readpos == 0) ? (GEIGERMINUTES - 1) : (readpos - 1);
+    if (minutevals[ch][readpos] != 0xffff) {
       numvalid++;
-      sum += geiger_valuehistory[readpos];
+      sum += minutevals[ch][readpos];
     }
   }
-  sei();
-  if (numvalid > (2 * 30)) { /* Require at least 30 minutes of valid data */
-    return (sum * 2 / numvalid);
+  if ((numvalid > 0) && (numvalid >= minvalid)) {
+    return sum / numvalid;
   } else {
     return 0xffffff;
   }
 }
 
-uint16_t geiger_getticks(void)
+uint32_t geiger_getminuteavg(uint8_t ch, uint8_t nminutes)
+{
+  uint32_t res;
+  SYSMON_CLI(SYSMON_CS_GEIGERAVG);
+  res = getminuteavg_noirq(ch, nminutes);
+  SYSMON_SEI(SYSMON_CS_GEIGERAVG);
+  return res;
+}
+
+static uint32_t getavgsecs_noirq(uint8_t ch, uint16_t secs)
+{
+  uint32_t n = (CLOCK_SECONDS(secs) + (bucketlen / 2)) / bucketlen;
+  if (n == 0) {
+    n = 1;
+  }
+  if ((n > SIZEOFGEIGERHISTORY) && (bucketsperminute > 0)) {
+    /* Does not fit into the history of buckets, use the minutes */
+    return getminuteavg_noirq(ch, (secs + 30) / 60);
+  }
+  return getavg_noirq(ch, (n > SIZEOFGEIGERHISTORY) ? SIZEOFGEIGERHISTORY : n);
+}
+
+uint32_t geiger_getavgsecs(uint8_t ch, uint16_t secs)
+{
+  uint32_t res;
+  SYSMON_CLI(SYSMON_CS_GEIGERAVG);
+  res = getavgsecs_noirq(ch, secs);
+  SYSMON_SEI(SYSMON_CS_GEIGERAVG);
+  return res;
+}
+
+/* This can only be called safely with interrupts disabled - remember that! */
+uint32_t geiger_getewma_noirq(uint8_t ch, uint8_t which, float * variance)
+{
+  uint32_t cpm;
+  if (!(ewmavalid[ch] & _BV(which))) {
+    return 0xffffff;
+  }
+  cpm = tocpm(ewmaval[ch][which], (uint32_t)ewmaupdlen[which] << 16);
+  if (variance != NULL) {
+    /* Poisson: the variance of the counts equals their mean. Smoothing
+     * with alpha scales that by alpha / (2 - alpha). */
+    *variance = cpm * ewmavarfactor[which];
+  }
+  return cpm;
+}
+
+uint32_t geiger_getewma(uint8_t ch, uint8_t which, float * variance)
+{
+  uint32_t res;
+  SYSMON_CLI(SYSMON_CS_GEIGERAVG);
+  res = geiger_getewma_noirq(ch, which, variance);
+  SYSMON_SEI(SYSMON_CS_GEIGERAVG);
+  return res;
+}
+
+uint32_t geiger_get1minavg(uint8_t ch)
+{
+  return geiger_getavgsecs(ch, 60);
+}
+
+uint32_t geiger_get60minavg(uint8_t ch)
+{
+  return geiger_getavgsecs(ch, 60 * 60);
+}
+
+/* Start a new variable integration time measurement now. */
+static void vistart_noirq(void)
+{
+  vistart = clock_now_noirq();
+  vistartcount = totalcount[0] + currentgeigcount[0];
+}
+
+void geiger_setvi(uint16_t uncert, uint16_t mintime, uint16_t maxtime)
+{
+  if ((uncert == viuncert) && (CLOCK_SECONDS((uint32_t)mintime) == vimintime)
+   && (CLOCK_SECONDS((uint32_t)maxtime) == vimaxtime)) {
+    return; /* Nothing changed, keep the measurement that is running. */
+  }
+  viuncert = uncert;
+  vimintime = CLOCK_SECONDS((uint32_t)mintime);
+  vimaxtime = CLOCK_SECONDS((uint32_t)maxtime);
+  if (vimaxtime < vimintime) {
+    vimaxtime = vimintime;
+  }
+  /* 1/sqrt(N) = uncert / 1000  =>  N = 1000000 / uncert^2, rounded up */
+  if (uncert == 0) {
+    vitarget = 0;
+  } else {
+    vitarget = (1000000UL + ((uint32_t)uncert * uncert) - 1) / ((uint32_t)uncert * uncert);
+  }
+  vihaveresult = 0;
+  cli();
+  vistart_noirq();
+  sei();
+}
+
+uint8_t geiger_viwork(void)
+{
+  uint32_t now, n, elapsed;
+  if (vitarget == 0) {
+    return 0;
+  }
+  SYSMON_CLI(SYSMON_CS_GEIGERAVG);
+  now = clock_now_noirq();
+  n = totalcount[0] + currentgeigcount[0] - vistartcount;
+  SYSMON_SEI(SYSMON_CS_GEIGERAVG);
+  elapsed = now - vistart;
+  if ((elapsed < vimintime) || ((n < vitarget) && (elapsed < vimaxtime))) {
+    return 0; /* Not done yet */
+  }
+  viresult.counts = n;
+  viresult.cpm = tocpm(n, elapsed);
+  viresult.secs = (elapsed > CLOCK_SECONDS(65535UL)) ? 65535 : ((elapsed + (CLOCK_HZ / 2)) / CLOCK_HZ);
+  viresult.uncert = (n == 0) ? 1000 : (uint16_t)(1000.0 / sqrt(n) + 0.5);
+  vihaveresult = 1;
+  /* The next one starts exactly where this one ended, so no count is lost. */
+  vistart = now;
+  vistartcount += n;
+  return 1;
+}
+
+uint8_t geiger_getvi(struct geigerviresult * res)
+{
+  if (!vihaveresult) {
+    return 0;
+  }
+  *res = viresult;
+  return 1;
+}
+
+/* This can only be called safely with interrupts disabled - remember that! */
+uint32_t geiger_getbuckettime_noirq(void)
+{
+  return lastbuckettime;
+}
+
+uint8_t geiger_getentropy(void)
+{
+  return pulseentropy;
+}
+
+uint16_t geiger_getbucketcount(void)
 {
   uint16_t res;
   cli();
-  res = ticks;
+  res = bucketcount;
+  sei();
+  return res;
+}
+
+uint16_t geiger_getbucketlen(void)
+{
+  return bucketlen;
+}
+
+uint16_t geiger_gethistory(uint8_t ch, uint16_t bucket)
+{
+  uint16_t res = 0xffff;
+  uint16_t age;
+  cli();
+  age = bucketcount - bucket;
+  /* We do not know when the stale buckets were, so we cannot upload them */
+  if ((age < SIZEOFGEIGERHISTORY) && !isstale(bucket)) {
+    /* The newest finished bucket is just before historypos */
+    uint16_t idx = (historypos + (2 * SIZEOFGEIGERHISTORY) - 1 - age) % SIZEOFGEIGERHISTORY;
+    res = histvalue_noirq(ch, idx, age);
+  }
   sei();
   return res;
 }
 
-void geiger_init(void)
-{
-  /* Mark all values in the history as 'invalid' because they haven't been collected yet */
-  for (uint8_t i = 0; i < SIZEOFGEIGERHISTORY; i++) {
-    geiger_valuehistory[i] = 0xffff;
-  }
-  /* the number of timer ticks in 30 seconds can be cleanly divided by 5. */
-  ICR3H = (234375UL / 5) >> 8;
-  ICR3L = (234375UL / 5) & 0xff;
-  /* Set CTC-mode with the MAX taken from ICR3.
-   * Select prescaler /1024, this results in 234375 timer-ticks in 30 seconds. */
-  TCCR3A = 0x00;
-  TCCR3B = _BV(WGM33) | _BV(WGM32) | _BV(CS32) | _BV(CS30);
-  TIMSK3 |= _BV(ICIE3);
-  TIFR3 |= _BV(ICF3);
-  /* Enable pullups on PD0 (which is where the geiger counter is connected) */
-  DDRD &= (uint8_t)~_BV(PD0);
-  PORTD |= _BV(PD0);
-  /* and enable pin generation on falling edge from that pin. */
-  EICRA = (EICRA & 0x03) | _BV(ISC01);
-  EIMSK |= _BV(INT0);
+static uint16_t calcnoinitsum(void)
+{
+  uint16_t res = noinitmagic + bucketlen + bucketage
+               + historypos + bucketcount
+               + journalledcount + journalslot
+               + minutepos + minutebuckets + recentpos
+               + stalebucket + havestale;
+  for (uint8_t ch = 0; ch < GEIGER_NUMCOUNTERS; ch++) {
+    res += currentgeigcount[ch] + minuteacc[ch];
+    for (uint16_t i = 0; i < HISTBYTES; i++) {
+      res += histvals[ch][i];
+    }
+    for (uint8_t i = 0; i < sizeof(histexp[ch]); i++) {
+      res += histexp[ch][i];
+    }
+    for (uint8_t i = 0; i < HISTBLOCKS; i++) {
+      res += histblocksum[ch][i];
+    }
+    for (uint8_t i = 0; i < HISTRECENT; i++) {
+      res += histrecent[ch][i];
+    }
+    for (uint8_t i = 0; i < GEIGERMINUTES; i++) {
+      res += minutevals[ch][i];
+    }
+  }
+  return res;
+}
+
+/* The bucket length goes into the CRC too: records that were written with
+ * a different bucket length will not be restored. */
+static uint8_t journalreccrc(struct geigerjournalrec * r)
+{
+  uint8_t res = 0;
+  uint8_t * p = (uint8_t *)r;
+  res = _crc_ibutton_update(res, bucketlen & 0xff);
+  res = _crc_ibutton_update(res, bucketlen >> 8);
+  for (uint8_t i = 0; i < offsetof(struct geigerjournalrec, crc); i++) {
+    res = _crc_ibutton_update(res, p[i]);
+  }
+  return res;
+}
+
+/* Read journal record from slot. Returns 0 if it is not valid. */
+static uint8_t readjournalrec(uint8_t slot, struct geigerjournalrec * r)
+{
+  eeprom_read_block(r, &ee_geigerjournal[slot], sizeof(struct geigerjournalrec));
+  return (r->crc == journalreccrc(r));
+}
+
+/* How many valid records with consecutive timestamps end in slot?
+ * We don't care about more than SIZEOFGEIGERHISTORY. */
+static uint16_t journalrunlength(uint8_t slot)
+{
+  struct geigerjournalrec r;
+  uint16_t res = 0;
+  uint16_t expectedts;
+  if (!readjournalrec(slot, &r)) {
+    return 0;
+  }
+  do {
+    res++;
+    expectedts = r.ts - 1;
+    slot = (slot == 0) ? (GEIGERJOURNALSIZE - 1) : (slot - 1);
+  } while ((res < SIZEOFGEIGERHISTORY) && readjournalrec(slot, &r) && (r.ts == expectedts));
+  return res;
+}
+
+/* The number of the newest stale bucket in the journal (ee_geigerstale):
+ * the upper half holds the inverse, so an erased EEPROM means none. */
+static uint8_t readstalemarker(uint16_t * bucket)
+{
+  uint32_t m = eeprom_read_dword(&ee_geigerstale);
+  *bucket = m & 0xffff;
+  return ((m >> 16) == (uint16_t)~*bucket);
+}
+
+static void writestalemarker(uint8_t valid, uint16_t bucket)
+{
+  eeprom_update_dword(&ee_geigerstale,
+                      valid ? (((uint32_t)(uint16_t)~bucket << 16) | bucket) : 0xffffffffUL);
+}
+
+/* Restore the history from the journal in the EEPROM. The newest entry in
+ * the journal is the end of the longest run of valid records with
+ * consecutive timestamps. Note that we cannot know how long we were
+ * switched off, so the restored history is numbered as if it was from
+ * just before this boot. If we lost our supply, it is marked stale (see
+ * geiger_init()). */
+static void restorehistory(uint8_t powerlost)
+{
+  struct geigerjournalrec r, rnext;
+  uint8_t newest = 0;
+  uint16_t bestlen = 0;
+  for (uint8_t slot = 0; slot < GEIGERJOURNALSIZE; slot++) {
+    uint8_t nextslot = (slot + 1) % GEIGERJOURNALSIZE;
+    if (!readjournalrec(slot, &r)) {
+      continue;
+    }
+    if (readjournalrec(nextslot, &rnext) && (rnext.ts == (uint16_t)(r.ts + 1))) {
+      continue; /* Not the end of a run */
+    }
+    uint16_t len = journalrunlength(slot);
+    if (len > bestlen) {
+      bestlen = len;
+      newest = slot;
+    }
+  }
+  if (bestlen == 0) { /* Nothing in the journal */
+    writestalemarker(0, 0); /* and we start counting the buckets from 0 */
+    return;
+  }
+  /* Copy the run into the history, newest value last. */
+  uint8_t slot = newest;
+  for (uint16_t i = bestlen; i > 0; i--) {
+    readjournalrec(slot, &r);
+    histstore_noirq(0, i - 1, r.value);
+    if (i == bestlen) {
+      bucketcount = r.ts;
+    }
+    slot = (slot == 0) ? (GEIGERJOURNALSIZE - 1) : (slot - 1);
+  }
+  historypos = bestlen % SIZEOFGEIGERHISTORY;
+  journalledcount = bucketcount;
+  journalslot = (newest + 1) % GEIGERJOURNALSIZE;
+  restoredbuckets = bestlen;
+  if (powerlost) {
+    writestalemarker(1, bucketcount);
+  }
+  /* This also finds the stale buckets of an earlier power loss */
+  if (readstalemarker(&stalebucket) && ((uint16_t)(bucketcount - stalebucket) < bestlen)) {
+    havestale = 1;
+    restoredstale = bestlen - (uint16_t)(bucketcount - stalebucket);
+  }
+}
+
+void geiger_journalwork(void)
+{
+  struct geigerjournalrec r;
+  uint16_t sb;
+  uint16_t bc;
+  uint16_t pos;
+  cli();
+  bc = bucketcount;
+  pos = historypos;
+  sei();
+  uint16_t behind = bc - journalledcount;
+  if (bucketlen < GEIGERMINJOURNALLEN) {
+    /* Short buckets are not journalled, that would wear out the EEPROM */
+    cli();
+    noinitsum += bc - journalledcount;
+    journalledcount = bc;
+    sei();
+    return;
+  }
+  if (behind > SIZEOFGEIGERHISTORY) { /* Should not happen: we missed some */
+    cli();
+    noinitsum += (bc - SIZEOFGEIGERHISTORY) - journalledcount;
+    journalledcount = bc - SIZEOFGEIGERHISTORY;
+    sei();
+    behind = SIZEOFGEIGERHISTORY;
+  }
+  while (behind > 0) {
+    /* The bucket stays where it is, but a bucket ending meanwhile may
+     * rescale its block and moves the ring of recent counts on, so we
+     * need interrupts disabled, and its age as of now. */
+    uint16_t idx = (pos >= behind) ? (pos - behind) : (pos + SIZEOFGEIGERHISTORY - behind);
+    r.ts = journalledcount + 1;
+    cli();
+    r.value = histvalue_noirq(0, idx, (historypos + (2 * SIZEOFGEIGERHISTORY) - 1 - idx) % SIZEOFGEIGERHISTORY);
+    sei();
+    r.crc = journalreccrc(&r);
+    eeprom_update_block(&r, &ee_geigerjournal[journalslot], sizeof(r));
+    cli(); /* noinitsum is also modified from the interrupt */
+    noinitsum -= journalslot;
+    journalslot = (journalslot + 1) % GEIGERJOURNALSIZE;
+    journalledcount++;
+    noinitsum += journalslot + 1;
+    sei();
+    behind--;
+  }
+  /* Once the stale records have all been overwritten, forget about them -
+   * the bucket numbers will come round again eventually. */
+  if (readstalemarker(&sb) && ((uint16_t)(journalledcount - sb) >= GEIGERJOURNALSIZE)) {
+    writestalemarker(0, 0);
+  }
+}
+
+uint8_t geiger_getrestoredbuckets(void)
+{
+  return restoredbuckets;
+}
+
+uint8_t geiger_getrestoredstale(void)
+{
+  return restoredstale;
+}
+
+/* Throw away all history. Must be called with interrupts disabled. */
+static void resethistory_noirq(void)
+{
+  bucketage = 0;
+  historypos = 0;
+  bucketcount = 0;
+  journalledcount = 0;
+  journalslot = 0;
+  minutepos = 0;
+  minutebuckets = 0;
+  recentpos = 0;
+  havestale = 0;
+  for (uint8_t ch = 0; ch < GEIGER_NUMCOUNTERS; ch++) {
+    totalcount[ch] += currentgeigcount[ch];
+    currentgeigcount[ch] = 0;
+    /* Mark all values in the history as 'invalid' because they haven't been collected yet */
+    /* (all bits set is HISTINVALID in every bucket, and exponent 0) */
+    for (uint16_t i = 0; i < HISTBYTES; i++) {
+      histvals[ch][i] = 0xff;
+    }
+    for (uint8_t i = 0; i < sizeof(histexp[ch]); i++) {
+      histexp[ch][i] = 0;
+    }
+    for (uint8_t i = 0; i < HISTBLOCKS; i++) {
+      histblocksum[ch][i] = 0;
+    }
+    for (uint8_t i = 0; i < HISTRECENT; i++) {
+      histrecent[ch][i] = 0xffff;
+    }
+    for (uint8_t i = 0; i < GEIGERMINUTES; i++) {
+      minutevals[ch][i] = 0xffff;
+    }
+    minuteacc[ch] = 0;
+  }
+}
+
+/* Bucket length in ms to clock.h units. 0 if that is not a valid bucket
+ * length: it needs to be a multiple of 125 ms (so it is a whole number
+ * of clock units), and either divide a minute or be a multiple of a
+ * minute, so that the minute history works. */
+static uint16_t mstobucketlen(uint32_t ms)
+{
+  uint16_t len;
+  if ((ms < GEIGER_MINBUCKETMS) || (ms > GEIGER_MAXBUCKETMS) || ((ms % 125) != 0)) {
+    return 0;
+  }
+  len = (ms * 8) / 125;
+  if (((CLOCK_SECONDS(60) % len) != 0) && ((len % CLOCK_SECONDS(60)) != 0)) {
+    return 0;
+  }
+  return len;
+}
+
+uint8_t geiger_isvalidbucketms(uint32_t ms)
+{
+  return (mstobucketlen(ms) != 0);
+}
+
+/* Calculate the parameters of the moving averages for the current bucket
+ * length, and start them from the windowed averages if there are any.
+ * This uses floating point, but only runs when the bucket length changes. */
+static void setupewma_noirq(void)
+{
+  ewmaperminute = 0;
+  for (uint8_t i = 0; i < GEIGER_NUMEWMA; i++) {
+    uint16_t tau = pgm_read_word(&ewmatau[i]);
+    uint16_t upd = bucketlen;
+    float a;
+    if ((bucketsperminute > 0) && (tau >= (10 * 60))) {
+      upd = CLOCK_SECONDS(60);
+      ewmaperminute |= _BV(i);
+    }
+    a = 1.0 - exp(-(float)upd / (float)CLOCK_SECONDS(tau));
+    ewmaalpha[i] = (a >= 1.0) ? 0xffffffffUL : (uint32_t)(a * 4294967296.0);
+    ewmavarfactor[i] = ((float)CLOCK_SECONDS(60) / upd) * a / (2.0 - a);
+    ewmaupdlen[i] = upd;
+    for (uint8_t ch = 0; ch < GEIGER_NUMCOUNTERS; ch++) {
+      uint32_t cpm = getavgsecs_noirq(ch, tau);
+      if (i == 0) {
+        ewmavalid[ch] = 0;
+      }
+      if (cpm != 0xffffff) {
+        float e = (float)cpm * upd / CLOCK_SECONDS(60);
+        ewmaval[ch][i] = (e >= 65535.0) ? 0xffffffffUL : (uint32_t)(e * 65536.0);
+        ewmavalid[ch] |= _BV(i);
+      }
+    }
+  }
+}
+
+/* Set bucketsperminute, the moving averages and the bucket alarm for the
+ * next bucket, which ends after remaining. Must be called with interrupts
+ * disabled. */
+static void startbuckets_noirq(uint16_t remaining)
+{
+  if (bucketlen < CLOCK_SECONDS(60)) {
+    bucketsperminute = CLOCK_SECONDS(60) / bucketlen;
+  } else {
+    bucketsperminute = 0;
+  }
+  setupewma_noirq();
+  nextbucketend = clock_now_noirq() + remaining;
+  clock_setbucketalarm_noirq(nextbucketend);
+}
+
+uint8_t geiger_setbucketms(uint32_t ms)
+{
+  uint16_t len = mstobucketlen(ms);
+  if (len == 0) {
+    return 0;
+  }
+  if (len == bucketlen) {
+    return 1;
+  }
+  /* The old history is useless with a different bucket length, and the
+   * bucket numbers start from 0 again. */
+  writestalemarker(0, 0);
+  cli();
+  bucketlen = len;
+  resethistory_noirq();
+  noinitsum = calcnoinitsum();
+  startbuckets_noirq(bucketlen);
+  sei();
+  return 1;
+}
+
+uint8_t geiger_init(uint8_t resetflags, uint32_t bucketms)
+{
+  uint8_t warm = 0;
+  uint16_t len = mstobucketlen(bucketms);
+  uint16_t remaining;
+  if (len == 0) {
+    len = mstobucketlen(GEIGER_BUCKETMS);
+  }
+  /* After a watchdog or external reset, the RAM still holds our history,
+   * and there is no need to initialize anything. Note that we might not
+   * know the reset cause (some bootloaders clear MCUSR), but then the
+   * checksum will tell us. */
+  if (((resetflags & (_BV(PORF) | _BV(BORF))) == 0)
+   && (noinitmagic == NOINITMAGIC)
+   && (noinitsum == calcnoinitsum())
+   && (bucketlen == len)
+   && (historypos < SIZEOFGEIGERHISTORY)
+   && (minutepos < GEIGERMINUTES)
+   && (recentpos < HISTRECENT)
+   && (journalslot < GEIGERJOURNALSIZE)) {
+    warm = 1;
+  }
+  if (!warm) {
+    /* Cold start */
+    bucketlen = len;
+    resethistory_noirq();
+    /* and then fill in what we saved before the reset. After losing
+     * power (power-on or brown-out reset, or an unknown reset cause), we
+     * have no idea how long we were off: on a solar powered unit that may
+     * well have been a whole night, and old data passed off as the current
+     * average is worse than none. So those buckets are stale: the averages
+     * and the history upload leave them out. We still restore them, so
+     * the journal continues after them - otherwise a later reset could
+     * find the old run longer than the new one and restore that instead. */
+    restorehistory(((resetflags & (_BV(PORF) | _BV(BORF))) != 0)
+                || ((resetflags & (_BV(WDRF) | _BV(EXTRF) | _BV(JTRF))) == 0));
+  }
+  /* Continue the current bucket for the time it still has left (we only
+   * know that to 6 seconds though). */
+  if (((uint32_t)bucketage * CLOCK_PERIOD) < bucketlen) {
+    remaining = bucketlen - (bucketage * CLOCK_PERIOD);
+  } else {
+    remaining = 1;
+  }
+  noinitmagic = NOINITMAGIC;
+  noinitsum = calcnoinitsum();
+  startbuckets_noirq(remaining);
+#if (GEIGER_NUMCHANNELS > 1)
+  for (uint8_t i = 0; i < GEIGER_NUMCHANNELS; i++) {
+    lastpulse[i] = NOPULSE;
+  }
+#endif /* GEIGER_NUMCHANNELS > 1 */
+  /* The tubes are on PD0-PD3, which are also INT0-INT3. Enable the pullups
+   * there, and enable the interrupts on the falling edge of those pins. */
+  for (uint8_t i = 0; i < GEIGER_NUMCHANNELS; i++) {
+    DDRD &= (uint8_t)~_BV(PD0 + i);
+    PORTD |= _BV(PD0 + i);
+    EICRA = (EICRA & (uint8_t)~(0x03 << (i * 2))) | (_BV(ISC01) << (i * 2));
+    EIMSK |= _BV(INT0 + i);
+  }
+  return warm;
 }
 
@@ -6,21 +6,136 @@
 #ifndef _GEIGER_H_
 #define _GEIGER_H_
 
-/* These can also be accessed directly, but be aware that these could be
- * modified while you read them, unless you disable interrupts! */
-#define SIZEOFGEIGERHISTORY (2 * 60) /* 1 hour in 30 second steps */
-extern uint16_t geiger_valuehistory[SIZEOFGEIGERHISTORY];
-extern uint8_t geiger_historypos;
-
-/* General initialization */
-void geiger_init(void);
-
-/* Get data */
-uint32_t geiger_get1minavg(void);
-uint32_t geiger_get60minavg(void);
-
-/* Our "tick" value might be useful elsewhere too, so export it.
- * One tick equals 6 seconds of uptime. So this overflows after about 4.5 days. */
-uint16_t geiger_getticks(void);
+/* The length of a bucket in ms, i.e. how long we count before we store the
+ * count in the history. This is the default, it can be changed at runtime.
+ * It needs to be a multiple of 125 ms, and either divide a minute or
+ * be a multiple of a minute. */
+#ifndef GEIGER_BUCKETMS
+#define GEIGER_BUCKETMS 30000UL
+#endif
+#define GEIGER_MINBUCKETMS 125UL
+#define GEIGER_MAXBUCKETMS 600000UL
+
+/* How many geiger tubes there are, 1-4. They are connected to INT0 (PD0),
+ * INT1 (PD1), INT2 (PD2) and INT3 (PD3), in that order. */
+#ifndef GEIGER_NUMCHANNELS
+#define GEIGER_NUMCHANNELS 1
+#endif
+#if (GEIGER_NUMCHANNELS < 1) || (GEIGER_NUMCHANNELS > 4)
+#error "GEIGER_NUMCHANNELS needs to be between 1 and 4"
+#endif
+/* Every tube has its own counter with its own history. With more than one
+ * tube, there is one more counter for the coincidences: a pulse that
+ * arrives at most GEIGER_COINCTICKS Timer3 ticks (128 us each) after a
+ * pulse on another tube. With the default, that is 128 to 256 us. */
+#if (GEIGER_NUMCHANNELS > 1)
+#define GEIGER_COINCCOUNTER GEIGER_NUMCHANNELS
+#define GEIGER_NUMCOUNTERS  (GEIGER_NUMCHANNELS + 1)
+#else
+#define GEIGER_NUMCOUNTERS  1
+#endif
+#ifndef GEIGER_COINCTICKS
+#define GEIGER_COINCTICKS 1
+#endif
+
+/* How many buckets we keep. This takes 5 bits per bucket, plus 2.5
+ * bytes per block of GEIGERHISTBLOCK buckets and 4 bytes per bucket of
+ * the last block, for every counter (see geiger.c for details). With the
+ * defaults, that is 3 hours in 348 bytes.
+ * It needs to be a multiple of GEIGERHISTBLOCK. */
+#ifndef SIZEOFGEIGERHISTORY
+#define SIZEOFGEIGERHISTORY (6 * 60)
+#endif
+#define GEIGERHISTBLOCK 12
+#if ((SIZEOFGEIGERHISTORY % GEIGERHISTBLOCK) != 0)
+#error "SIZEOFGEIGERHISTORY needs to be a multiple of GEIGERHISTBLOCK"
+#endif
+/* How many minutes we keep for buckets shorter than a minute */
+#define GEIGERMINUTES 60
+
+/* General initialization. resetflags is the content of MCUSR at boot,
+ * bucketms the bucket length (see above). Returns 1 if the history
+ * survived the reset in RAM (warm restart). Needs to be called with
+ * interrupts disabled, after clock_init(). */
+uint8_t geiger_init(uint8_t resetflags, uint32_t bucketms);
+
+/* Change the bucket length. This throws away the history. Returns 0 if
+ * bucketms is not a valid bucket length. */
+uint8_t geiger_setbucketms(uint32_t bucketms);
+uint8_t geiger_isvalidbucketms(uint32_t bucketms);
+
+/* This needs to be called every 6 seconds, with interrupts disabled.
+ * clock.c does this from the Timer3 interrupt. */
+void geiger_tick_noirq(void);
+/* This is called from clock.c when the current bucket has ended. */
+void geiger_bucketend_noirq(void);
+
+/* Get data. ch is the counter, 0 to GEIGER_NUMCOUNTERS - 1. */
+uint32_t geiger_get1minavg(uint8_t ch);
+uint32_t geiger_get60minavg(uint8_t ch);
+/* Average over the last nbuckets buckets, in counts per minute.
+ * Returns 0xffffff if not enough valid data was collected yet. */
+uint32_t geiger_getavg(uint8_t ch, uint16_t nbuckets);
+/* Same for the last nminutes minutes. This only works for buckets
+ * shorter than a minute. */
+uint32_t geiger_getminuteavg(uint8_t ch, uint8_t nminutes);
+/* Average over the last secs seconds, using whichever of the above
+ * covers that. */
+uint32_t geiger_getavgsecs(uint8_t ch, uint16_t secs);
+/* Exponentially weighted moving averages, in counts per minute. These are
+ * updated with every bucket in constant time, and have no hard edges like
+ * the windowed averages. If variance is not NULL, the variance of the
+ * estimate (in CPM^2) that the Poisson statistics give goes there.
+ * Returns 0xffffff if there is no data yet. */
+#define GEIGER_NUMEWMA   3
+#define GEIGER_EWMA1MIN  0 /* time constant 1 minute */
+#define GEIGER_EWMA10MIN 1 /* 10 minutes */
+#define GEIGER_EWMA60MIN 2 /* 60 minutes */
+uint32_t geiger_getewma(uint8_t ch, uint8_t which, float * variance);
+/* Same, for use with interrupts disabled */
+uint32_t geiger_getewma_noirq(uint8_t ch, uint8_t which, float * variance);
+
+/* Variable integration time measurement (of the first tube): count until the relative
+ * uncertainty 1/sqrt(counts) is at most uncert (in 0.1%), but at least
+ * for mintime and at most for maxtime seconds. So at high rates there is
+ * a new value every mintime seconds, and at low rates the values have a
+ * known accuracy. uncert 0 turns this off. Changing the parameters
+ * restarts the measurement. */
+struct geigerviresult {
+  uint32_t cpm;    /* counts per minute */
+  uint32_t counts; /* how many counts this is based on */
+  uint16_t secs;   /* integration time in seconds */
+  uint16_t uncert; /* relative uncertainty (1 sigma) in 0.1% */
+};
+void geiger_setvi(uint16_t uncert, uint16_t mintime, uint16_t maxtime);
+/* Call this regularly, about once per second. Returns 1 when a measurement
+ * has just finished. Not with interrupts disabled! */
+uint8_t geiger_viwork(void);
+/* The last finished measurement. Returns 0 if there is none yet. */
+uint8_t geiger_getvi(struct geigerviresult * res);
+
+/* Writes finished buckets of the first tube to the journal in the EEPROM. Call this
+ * regularly from the main loop (not with interrupts disabled!). */
+void geiger_journalwork(void);
+/* Number of buckets that were restored from the journal on boot, and how
+ * many of those are from before a power loss. Those are not used for the
+ * averages or uploaded, as we do not know how old they are. */
+uint8_t geiger_getrestoredbuckets(void);
+uint8_t geiger_getrestoredstale(void);
+
+/* When the last bucket was finished, as a clock.h timestamp.
+ * Needs to be called with interrupts disabled. */
+uint32_t geiger_getbuckettime_noirq(void);
+
+/* For uploading the history: the number of the newest finished bucket,
+ * the bucket length in clock.h units, and the value of bucket number
+ * bucket of counter ch (0xffff if invalid, or no longer in the history). */
+uint16_t geiger_getbucketcount(void);
+uint16_t geiger_getbucketlen(void);
+uint16_t geiger_gethistory(uint8_t ch, uint16_t bucket);
+
+/* A few bits of randomness from the timing of the pulses, for seeding
+ * the PRNG (prng.h). */
+uint8_t geiger_getentropy(void);
 
 #endif /* _GEIGER_H_ */
@@ -61,6 +61,9 @@
 
 		/* General USB Driver Related Tokens: */
 //		#define ORDERED_EP_CONFIG
+		/* Note: console.c only calls USB_Init() while VBUS is present, and
+		 * USB_Disable() when it goes away, so the regulator and PLL are
+		 * not running without a cable attached. */
 		#define USE_STATIC_OPTIONS               (USB_DEVICE_OPT_FULLSPEED | USB_OPT_REG_ENABLED | USB_OPT_AUTO_PLL)
 		#define USB_DEVICE_ONLY
 //		#define USB_HOST_ONLY
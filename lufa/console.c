@@ -43,11 +43,20 @@
 #include <avr/power.h>
 #include <avr/interrupt.h>
 #include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <avr/eeprom.h>
 
 #include "console.h"
 #include "Descriptors.h"
 #include <LUFA/Drivers/USB/USB.h>
+#include "../airtime.h"
 #include "../rfm69.h"
+#include "../clock.h"
+#include "../sched.h"
+#include "../sysmon.h"
+#include "../eeprom.h"
+#include "../geiger.h"
 
 
 #define INPUTBUFSIZE 30
@@ -74,10 +83,58 @@ static const uint8_t PROMPT[] PROGMEM = "\r\n# ";
  * Note: Since we execute from interrupt context, we might occasionally
  * get corrupted values in the uint16_t and uint32_ts.
  */
-extern uint16_t batvolt;
+extern uint16_t batmv;
+extern uint16_t vccmv;
+extern int8_t mcutemp;
 extern uint32_t pktssent;
+extern uint8_t resetcause;
+extern uint8_t warmstart;
 extern uint32_t geigcntavg1min;
 extern uint32_t geigcntavg60min;
+extern uint16_t txdeferred;
+extern uint16_t txawaketicks;
+extern uint16_t txawakemax;
+extern uint16_t txradioticks;
+extern uint16_t lbtbusy;
+extern uint16_t lbtforced;
+extern uint16_t dlaccepted;
+extern uint16_t dlrejected;
+extern uint16_t histfailed;
+/* The runtime settings, and the flag telling main to apply and save them. */
+extern struct settings settings;
+extern volatile uint8_t settingschanged;
+
+/* Description of the settings that can be changed with get / set */
+struct settingdesc {
+  char name[12];
+  uint8_t offset;
+  uint8_t size;
+  uint32_t min;
+  uint32_t max;
+};
+static const struct settingdesc settingdescs[] PROGMEM = {
+  { "txinterval",  offsetof(struct settings, txinterval),  1, 1, 255 },
+  { "rfmfreq",     offsetof(struct settings, rfmfreq),     4, 860000UL, 870000UL },
+  { "rfmdatarate", offsetof(struct settings, rfmdatarate), 4, 1200UL, 300000UL },
+  { "rfmpower",    offsetof(struct settings, rfmpower),    1, 0, 31 },
+  { "avgwinshort", offsetof(struct settings, avgwinshort), 2, 1, 65535UL },
+  { "avgwinlong",  offsetof(struct settings, avgwinlong),  2, 1, 65535UL },
+  { "alarmcpm",    offsetof(struct settings, alarmcpm),    4, 0, 0xffffffUL },
+  { "bucketms",    offsetof(struct settings, bucketms),    4, GEIGER_MINBUCKETMS, GEIGER_MAXBUCKETMS },
+  { "txavg",       offsetof(struct settings, txavg),       1, 0, 2 },
+  { "viuncert",    offsetof(struct settings, viuncert),    2, 0, 1000 },
+  { "vimintime",   offsetof(struct settings, vimintime),   2, 1, 65535UL },
+  { "vimaxtime",   offsetof(struct settings, vimaxtime),   2, 1, 65535UL },
+  { "txformat",    offsetof(struct settings, txformat),    1, 0, 2 },
+  { "rxevery",     offsetof(struct settings, rxevery),     1, 0, 255 },
+  { "rxwindow",    offsetof(struct settings, rxwindow),    1, 1, 200 },
+  { "txslot",      offsetof(struct settings, txslot),      1, 0, 1 },
+  { "lbt",         offsetof(struct settings, lbt),         1, 0, 127 },
+  { "txauto",      offsetof(struct settings, txauto),      1, 0, 1 },
+  { "histupload",  offsetof(struct settings, histupload),  1, 0, 255 },
+  { "tempoffset",  offsetof(struct settings, tempoffset),  1, 88, 168 },
+};
+#define NUMSETTINGS (sizeof(settingdescs) / sizeof(settingdescs[0]))
 
 /* Contains the current baud rate and other settings of the virtual serial port. While this demo does not use
  *  the physical USART and thus does not use these settings, they must still be retained and returned to the host
@@ -97,7 +154,8 @@ static CDC_LineEncoding_t LineEncoding = { .BaudRateBPS = 0,
  */
 void EVENT_USB_Device_Connect(void)
 {
-  /* Nothing to do? */
+  /* Let console_work() bring up USB */
+  sched_wake(SCHED_TASK_CONSOLE);
 }
 
 /* Event handler for the USB_Disconnect event. This indicates that the device is
@@ -109,6 +167,7 @@ void EVENT_USB_Device_Disconnect(void)
   inputpos = 0;
   outputhead = 0;
   outputtail = 0;
+  sched_wake(SCHED_TASK_CONSOLE);
 }
 
 /** Event handler for the USB_ConfigurationChanged event. This is fired when the host set the current configuration
@@ -125,6 +184,23 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 
 	/* Reset line encoding baud rate so that the host knows to send new values */
 	LineEncoding.BaudRateBPS = 0;
+
+	/* Have the USB controller wake us up on every Start Of Frame, see below. */
+	USB_Device_EnableSOFEvents();
+}
+
+/* Event handler for the USB Start Of Frame event. This fires every 1 ms
+ * while we are connected to a host. The only purpose of this interrupt is
+ * to wake the CPU from sleep and tell the scheduler to run the console
+ * task, i.e. console_work(), which services the CDC endpoints. That
+ * way we can sleep while USB is configured and still have a console that
+ * reacts within a millisecond.
+ * We cannot use interrupts from the CDC endpoints for this: LUFAs
+ * USB_COM_vect (INTERRUPT_CONTROL_ENDPOINT) assumes every endpoint
+ * interrupt is a control request on endpoint 0. */
+void EVENT_USB_Device_StartOfFrame(void)
+{
+  sched_wake(SCHED_TASK_CONSOLE);
 }
 
 /** Event handler for the USB_ControlRequest event. This is used to catch and process control requests sent to
@@ -190,6 +266,30 @@ static void appendchar(uint8_t what) {
   }
 }
 
+/* Print name and value of setting number i.
+ * This can only be called safely with interrupts disabled - remember that! */
+static void console_printsetting_noirq(uint8_t i) {
+  uint8_t tmpbuf[16];
+  uint32_t val = 0;
+  uint8_t * p = (uint8_t *)&settings + pgm_read_byte(&settingdescs[i].offset);
+  memcpy(&val, p, pgm_read_byte(&settingdescs[i].size));
+  console_printpgm_noirq_P(settingdescs[i].name);
+  appendchar(' ');
+  sprintf_P(tmpbuf, PSTR("%lu"), val);
+  console_printtext_noirq(tmpbuf);
+}
+
+/* Find the setting named name. Returns NUMSETTINGS if there is none. */
+static uint8_t console_findsetting(const uint8_t * name) {
+  uint8_t i;
+  for (i = 0; i < NUMSETTINGS; i++) {
+    if (strcmp_P(name, settingdescs[i].name) == 0) {
+      break;
+    }
+  }
+  return i;
+}
+
 /* We do all query processing here.
  * This must be called with IRQs disabled.
  */
@@ -270,6 +370,13 @@ static void console_inputchar(uint8_t inpb) {
             console_printpgm_noirq_P(PSTR("\r\n motd             repeat welcome message"));
             console_printpgm_noirq_P(PSTR("\r\n showpins [x]     shows the avrs inputpins"));
             console_printpgm_noirq_P(PSTR("\r\n status           show status / counters"));
+            console_printpgm_noirq_P(PSTR("\r\n sysmon [reset]   show stack / RAM usage"));
+            console_printpgm_noirq_P(PSTR("\r\n sched [reset]    show scheduler statistics"));
+            console_printpgm_noirq_P(PSTR("\r\n get [name]       show settings"));
+            console_printpgm_noirq_P(PSTR("\r\n set name value   change and save a setting"));
+            console_printpgm_noirq_P(PSTR("\r\n histupload       send the geiger history now"));
+            console_printpgm_noirq_P(PSTR("\r\n rfm69check       compare register shadow with RFM69"));
+            console_printpgm_noirq_P(PSTR("\r\n rfm69bench       measure SPI transfer times"));
           } else if (strcmp_P(inputbuf, PSTR("motd")) == 0) {
             console_printpgm_noirq_P(WELCOMEMSG);
           } else if (strncmp_P(inputbuf, PSTR("showpins"), 8) == 0) {
@@ -335,13 +442,82 @@ static void console_inputchar(uint8_t inpb) {
             uint8_t tmpbuf[40];
             console_printpgm_noirq_P(PSTR("Status / last measured values:\r\n"));
             console_printpgm_noirq_P(PSTR("LiPo battery voltage: "));
-            sprintf_P(tmpbuf, PSTR("%.2f"), (6.6 * batvolt) / 1023.0);
+            sprintf_P(tmpbuf, PSTR("%.3f"), batmv / 1000.0);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR("V\r\n"));
+            console_printpgm_noirq_P(PSTR("Supply voltage: "));
+            sprintf_P(tmpbuf, PSTR("%.3f"), vccmv / 1000.0);
             console_printtext_noirq(tmpbuf);
             console_printpgm_noirq_P(PSTR("V\r\n"));
+            console_printpgm_noirq_P(PSTR("MCU temperature: "));
+            sprintf_P(tmpbuf, PSTR("%d"), mcutemp);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR(" C\r\n"));
+            {
+              uint32_t now = clock_now_noirq();
+              uint32_t up = now / CLOCK_HZ;
+              console_printpgm_noirq_P(PSTR("Uptime: "));
+              sprintf_P(tmpbuf, PSTR("%lud %02u:%02u:%02u\r\n"), up / 86400UL,
+                        (uint16_t)((up / 3600UL) % 24), (uint16_t)((up / 60UL) % 60),
+                        (uint16_t)(up % 60));
+              console_printtext_noirq(tmpbuf);
+              console_printpgm_noirq_P(PSTR("Last geiger bucket finished: "));
+              sprintf_P(tmpbuf, PSTR("%lu s ago\r\n"),
+                        (uint32_t)CLOCK_DIFF(now, geiger_getbuckettime_noirq()) / CLOCK_HZ);
+              console_printtext_noirq(tmpbuf);
+            }
             console_printpgm_noirq_P(PSTR("Packets sent: "));
             sprintf_P(tmpbuf, PSTR("%10lu"), pktssent);
             console_printtext_noirq(tmpbuf);
             console_printpgm_noirq_P(PSTR("\r\n"));
+            {
+              uint32_t used = airtime_used_noirq();
+              console_printpgm_noirq_P(PSTR("Airtime last hour: "));
+              sprintf_P(tmpbuf, PSTR("%lu of %lu ms (%u.%02u%%)\r\n"), used, AIRTIME_BUDGETMS,
+                        (uint16_t)(used / 36000UL), (uint16_t)((used / 360UL) % 100));
+              console_printtext_noirq(tmpbuf);
+              console_printpgm_noirq_P(PSTR("Airtime budget: "));
+              sprintf_P(tmpbuf, PSTR("%u frames refused, "), airtime_getrefused_noirq());
+              console_printtext_noirq(tmpbuf);
+              sprintf_P(tmpbuf, PSTR("%u TX deferred\r\n"), txdeferred);
+              console_printtext_noirq(tmpbuf);
+            }
+            /* Timer3 ticks are 128 us */
+            console_printpgm_noirq_P(PSTR("Last TX: "));
+            sprintf_P(tmpbuf, PSTR("awake %lu us (max %lu), "),
+                      (uint32_t)txawaketicks * 128UL, (uint32_t)txawakemax * 128UL);
+            console_printtext_noirq(tmpbuf);
+            sprintf_P(tmpbuf, PSTR("radio on %lu us\r\n"), (uint32_t)txradioticks * 128UL);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR("Listen before talk: "));
+            sprintf_P(tmpbuf, PSTR("channel busy %u times, "), lbtbusy);
+            console_printtext_noirq(tmpbuf);
+            sprintf_P(tmpbuf, PSTR("sent anyways %u times\r\n"), lbtforced);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR("Downlink commands: "));
+            sprintf_P(tmpbuf, PSTR("%u accepted, %u rejected\r\n"), dlaccepted, dlrejected);
+            console_printtext_noirq(tmpbuf);
+            sprintf_P(tmpbuf, PSTR("History uploads failed: %u\r\n"), histfailed);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR("Last reset:"));
+            if (resetcause & _BV(PORF)) { console_printpgm_noirq_P(PSTR(" power-on")); }
+            if (resetcause & _BV(EXTRF)) { console_printpgm_noirq_P(PSTR(" external")); }
+            if (resetcause & _BV(BORF)) { console_printpgm_noirq_P(PSTR(" brown-out")); }
+            if (resetcause & _BV(WDRF)) { console_printpgm_noirq_P(PSTR(" watchdog")); }
+            if (resetcause & _BV(JTRF)) { console_printpgm_noirq_P(PSTR(" JTAG")); }
+            if ((resetcause & 0x1f) == 0) { console_printpgm_noirq_P(PSTR(" unknown")); }
+            if (warmstart) {
+              console_printpgm_noirq_P(PSTR(", warm start (state kept in RAM)\r\n"));
+            } else {
+              console_printpgm_noirq_P(PSTR(", cold start\r\n"));
+            }
+            console_printpgm_noirq_P(PSTR("Buckets restored from EEPROM on boot: "));
+            console_printdec_noirq(geiger_getrestoredbuckets());
+            if (geiger_getrestoredstale() > 0) {
+              console_printpgm_noirq_P(PSTR(", stale (from before a power loss): "));
+              console_printdec_noirq(geiger_getrestoredstale());
+            }
+            console_printpgm_noirq_P(PSTR("\r\n"));
             console_printpgm_noirq_P(PSTR("Geiger counter,  1 min average: "));
             if (geigcntavg1min > 0xfffff) {
               console_printpgm_noirq_P(PSTR("(no valid data)"));
@@ -357,6 +533,180 @@ static void console_inputchar(uint8_t inpb) {
               sprintf_P(tmpbuf, PSTR("%10lu"), geigcntavg60min);
               console_printtext_noirq(tmpbuf);
             }
+            for (uint8_t ch = 0; ch < GEIGER_NUMCOUNTERS; ch++) {
+              for (uint8_t i = 0; i < GEIGER_NUMEWMA; i++) {
+                static const uint8_t ewmamins[GEIGER_NUMEWMA] PROGMEM = { 1, 10, 60 };
+                float var;
+                uint32_t ewma = geiger_getewma_noirq(ch, i, &var);
+                console_printpgm_noirq_P(PSTR("\r\nGeiger counter"));
+#if (GEIGER_NUMCOUNTERS > 1)
+                if (ch == GEIGER_COINCCOUNTER) {
+                  console_printpgm_noirq_P(PSTR(" coincidences"));
+                } else {
+                  sprintf_P(tmpbuf, PSTR(" %u"), ch);
+                  console_printtext_noirq(tmpbuf);
+                }
+#endif /* GEIGER_NUMCOUNTERS > 1 */
+                sprintf_P(tmpbuf, PSTR(", moving average %2u min: "), pgm_read_byte(&ewmamins[i]));
+                console_printtext_noirq(tmpbuf);
+                if (ewma > 0xfffff) {
+                  console_printpgm_noirq_P(PSTR("(no valid data)"));
+                } else {
+                  sprintf_P(tmpbuf, PSTR("%10lu +- %.1f"), ewma, sqrt(var));
+                  console_printtext_noirq(tmpbuf);
+                }
+              }
+            }
+            {
+              struct geigerviresult vi;
+              if (geiger_getvi(&vi)) {
+                console_printpgm_noirq_P(PSTR("\r\nGeiger counter, variable time: "));
+                sprintf_P(tmpbuf, PSTR("%10lu +- %u.%u%%"), vi.cpm, vi.uncert / 10, vi.uncert % 10);
+                console_printtext_noirq(tmpbuf);
+                sprintf_P(tmpbuf, PSTR(" (%lu counts in %u s)"), vi.counts, vi.secs);
+                console_printtext_noirq(tmpbuf);
+              }
+            }
+          } else if (strncmp_P(inputbuf, PSTR("get"), 3) == 0) {
+            uint8_t i;
+            if (inputpos > 4) {
+              i = console_findsetting(&inputbuf[4]);
+              if (i < NUMSETTINGS) {
+                console_printsetting_noirq(i);
+              } else {
+                console_printpgm_noirq_P(PSTR("Unknown setting"));
+              }
+            } else {
+              for (i = 0; i < NUMSETTINGS; i++) {
+                console_printsetting_noirq(i);
+                if (i < (NUMSETTINGS - 1)) {
+                  appendchar('\r'); appendchar('\n');
+                }
+              }
+            }
+          } else if (strncmp_P(inputbuf, PSTR("set "), 4) == 0) {
+            uint8_t name[12];
+            uint32_t val;
+            uint8_t i = NUMSETTINGS;
+            if (sscanf_P(&inputbuf[4], PSTR("%11s %lu"), name, &val) == 2) {
+              i = console_findsetting(name);
+            }
+            if (i >= NUMSETTINGS) {
+              console_printpgm_noirq_P(PSTR("Usage: set name value - see 'get' for names"));
+            } else if ((val < pgm_read_dword(&settingdescs[i].min))
+                    || (val > pgm_read_dword(&settingdescs[i].max))) {
+              console_printpgm_noirq_P(PSTR("Value out of range"));
+            } else if ((pgm_read_byte(&settingdescs[i].offset) == offsetof(struct settings, bucketms))
+                    && !geiger_isvalidbucketms(val)) {
+              console_printpgm_noirq_P(PSTR("Needs to be a multiple of 125 ms that divides a minute or is a multiple of it"));
+            } else {
+              uint8_t * p = (uint8_t *)&settings + pgm_read_byte(&settingdescs[i].offset);
+              memcpy(p, &val, pgm_read_byte(&settingdescs[i].size));
+              settingschanged = 1; /* main() will apply and save this */
+              sched_wake(SCHED_TASK_HOUSEKEEPING);
+              console_printsetting_noirq(i);
+            }
+          } else if (strncmp_P(inputbuf, PSTR("sysmon"), 6) == 0) {
+            uint8_t tmpbuf[40];
+#if defined(SYSMON_CLITIMING)
+            if (strcmp_P(&inputbuf[6], PSTR(" reset")) == 0) {
+              sysmon_resetclimax_noirq();
+            }
+#endif /* SYSMON_CLITIMING */
+            console_printpgm_noirq_P(PSTR("Stack, max. used:  "));
+            sprintf_P(tmpbuf, PSTR("%5u bytes\r\n"), sysmon_stackmaxused());
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR("Stack, never used: "));
+            sprintf_P(tmpbuf, PSTR("%5u bytes\r\n"), sysmon_stackunused());
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR("Free RAM now:      "));
+            sprintf_P(tmpbuf, PSTR("%5u bytes\r\n"), sysmon_freeram());
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR("Heap used:         "));
+            sprintf_P(tmpbuf, PSTR("%5u bytes"), sysmon_heapused());
+            console_printtext_noirq(tmpbuf);
+#if defined(SYSMON_CLITIMING)
+            console_printpgm_noirq_P(PSTR("\r\nLongest time with IRQs disabled (us):"));
+            for (uint8_t i = 0; i < SYSMON_CS_COUNT; i++) {
+              switch (i) {
+              case SYSMON_CS_GEIGERAVG:
+                      console_printpgm_noirq_P(PSTR("\r\n geiger averages: "));
+                      break;
+              case SYSMON_CS_CLOCKREAD:
+                      console_printpgm_noirq_P(PSTR("\r\n clock read:      "));
+                      break;
+              case SYSMON_CS_CONSOLEWORK:
+                      console_printpgm_noirq_P(PSTR("\r\n console work:    "));
+                      break;
+              case SYSMON_CS_CONSOLEPRINT:
+                      console_printpgm_noirq_P(PSTR("\r\n console print:   "));
+                      break;
+              };
+              sprintf_P(tmpbuf, PSTR("%5u"), sysmon_getclimax_noirq(i));
+              console_printtext_noirq(tmpbuf);
+            }
+#endif /* SYSMON_CLITIMING */
+          } else if (strncmp_P(inputbuf, PSTR("sched"), 5) == 0) {
+            uint8_t tmpbuf[40];
+            if (strcmp_P(&inputbuf[5], PSTR(" reset")) == 0) {
+              sched_resetstats_noirq();
+            }
+            console_printpgm_noirq_P(PSTR("Task           runs  max.runtime  max.late"));
+            for (uint8_t i = 0; i < SCHED_NUMTASKS; i++) {
+              switch (i) {
+              case SCHED_TASK_SAMPLE:
+                      console_printpgm_noirq_P(PSTR("\r\n sample      "));
+                      break;
+              case SCHED_TASK_TRANSMIT:
+                      console_printpgm_noirq_P(PSTR("\r\n transmit    "));
+                      break;
+              case SCHED_TASK_HOUSEKEEPING:
+                      console_printpgm_noirq_P(PSTR("\r\n housekeeping"));
+                      break;
+              case SCHED_TASK_CONSOLE:
+                      console_printpgm_noirq_P(PSTR("\r\n console     "));
+                      break;
+              case SCHED_TASK_VARINT:
+                      console_printpgm_noirq_P(PSTR("\r\n varint      "));
+                      break;
+              case SCHED_TASK_HISTORY:
+                      console_printpgm_noirq_P(PSTR("\r\n history     "));
+                      break;
+              };
+              /* runtime is in timer ticks of 128 us, lateness in 1/64 s */
+              sprintf_P(tmpbuf, PSTR(" %5u %9lu ms %6lu ms"),
+                        sched_getruns_noirq(i),
+                        ((uint32_t)sched_getmaxruntime_noirq(i) * 128UL) / 1000UL,
+                        ((uint32_t)sched_getmaxlate_noirq(i) * 1000UL) / CLOCK_HZ);
+              console_printtext_noirq(tmpbuf);
+            }
+          } else if (strcmp_P(inputbuf, PSTR("histupload")) == 0) {
+            sched_wake(SCHED_TASK_HISTORY);
+            console_printpgm_noirq_P(PSTR("History upload started"));
+          } else if (strcmp_P(inputbuf, PSTR("rfm69check")) == 0) {
+            int16_t reg = -1;
+            uint8_t bad = 0;
+            while ((reg = rfm69_checkshadow(reg + 1)) >= 0) {
+              console_printpgm_noirq_P(PSTR("0x"));
+              console_printhex8_noirq(reg);
+              console_printpgm_noirq_P(PSTR(": shadow 0x"));
+              console_printhex8_noirq(rfm69_readregcached(reg));
+              console_printpgm_noirq_P(PSTR(" chip 0x"));
+              console_printhex8_noirq(rfm69_readreg(reg));
+              console_printpgm_noirq_P(PSTR("\r\n"));
+              bad++;
+            }
+            if (bad == 0) {
+              console_printpgm_noirq_P(PSTR("Register shadow matches the chip"));
+            }
+          } else if (strcmp_P(inputbuf, PSTR("rfm69bench")) == 0) {
+            uint8_t tmpbuf[40];
+            uint16_t regns, burstns;
+            rfm69_spibench(&regns, &burstns);
+            sprintf_P(tmpbuf, PSTR("Register access: %u ns\r\n"), regns);
+            console_printtext_noirq(tmpbuf);
+            sprintf_P(tmpbuf, PSTR("16 byte FIFO burst: %u ns"), burstns);
+            console_printtext_noirq(tmpbuf);
           } else if (strncmp_P(inputbuf, PSTR("rfm69reg"), 8) == 0) {
             uint8_t star = 0x01;
             uint8_t endr = 0x4f;  /* Show all relevant ones by default */
@@ -519,42 +869,71 @@ void console_printpgm_noirq_P(PGM_P what) {
 /* These are wrappers for our internal functions, disabling IRQs before
  * calling them. */
 void console_printtext(const uint8_t * what) {
-  cli();
+  SYSMON_CLI(SYSMON_CS_CONSOLEPRINT);
   console_printtext_noirq(what);
-  sei();
+  SYSMON_SEI(SYSMON_CS_CONSOLEPRINT);
 }
 
 void console_printpgm_P(PGM_P what) {
-  cli();
+  SYSMON_CLI(SYSMON_CS_CONSOLEPRINT);
   console_printpgm_noirq_P(what);
-  sei();
+  SYSMON_SEI(SYSMON_CS_CONSOLEPRINT);
 }
 
 void console_printhex8(uint8_t what) {
-  cli();
+  SYSMON_CLI(SYSMON_CS_CONSOLEPRINT);
   console_printhex8_noirq(what);
-  sei();
+  SYSMON_SEI(SYSMON_CS_CONSOLEPRINT);
 }
 
 void console_printdec(uint8_t what) {
-  cli();
+  SYSMON_CLI(SYSMON_CS_CONSOLEPRINT);
   console_printdec_noirq(what);
-  sei();
+  SYSMON_SEI(SYSMON_CS_CONSOLEPRINT);
+}
+
+/* Shut down USB completely (regulator, PLL, controller clock), only
+ * keeping the VBUS pad and its transition interrupt enabled. That
+ * interrupt works with the USB clock frozen and wakes us up when a cable
+ * gets plugged in; console_work() then brings up USB again.
+ * Must be called with interrupts disabled! */
+static void console_usbsleep(void)
+{
+  USB_Disable();
+  USBCON = _BV(USBE) | _BV(FRZCLK);
+  USBCON = _BV(USBE) | _BV(FRZCLK) | _BV(OTGPADE) | _BV(VBUSTE);
 }
 
 /* Initialize ourselves. Must be called with interrupts still disabled! */
 void console_init(void)
 {
-  USB_Init();
+  /* USB is only started once we see VBUS, see console_work(). */
+  console_usbsleep();
   console_printpgm_noirq_P(WELCOMEMSG);
   console_printpgm_noirq_P(PROMPT);
 }
 
 void console_work(void)
 {
-  cli();
+  /* Bring up USB when VBUS appears, and shut it down again when VBUS goes
+   * away - there is no point in wasting power on the USB regulator and
+   * PLL while no cable is connected. */
+  if (USB_VBUS_GetStatus()) {
+    if (!USB_IsInitialized) {
+      cli();
+      USB_Init();
+      sei();
+    }
+  } else {
+    if (USB_IsInitialized) {
+      cli();
+      console_usbsleep();
+      sei();
+    }
+  }
+  SYSMON_CLI(SYSMON_CS_CONSOLEWORK);
   CDC_Task();
-  sei();
+  SYSMON_SEI(SYSMON_CS_CONSOLEWORK);
 }
 
 uint8_t console_isusbconfigured(void) {
@@ -11,22 +11,37 @@
 #include <avr/sleep.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 
 #include "adc.h"
+#include "airtime.h"
+#include "downlink.h"
 #include "eeprom.h"
 #include "geiger.h"
+#include "prng.h"
 #include "rfm69.h"
+#include "sched.h"
+#include "sysmon.h"
 #include "lufa/console.h"
 
 /* The values last measured */
-/* Battery level. Range 0-1023, 1023 = our supply voltage * 2 = 6,6V
- * We send this shifted to the right by two as uint8_t (because the lower two
- * bits are just noise anyways) */
+/* Battery level. We oversample this by BATOVERSAMPLE bits, so the range is
+ * 0-4092, 4092 = our supply voltage * 2 (nominally 6,6V) */
+#define BATOVERSAMPLE 2
 uint16_t batvolt = 0;
-/* How often did we send a packet? */
-uint32_t pktssent = 0;
-/* Geigercounter values */
+/* Our supply voltage in mV, measured against the internal bandgap */
+uint16_t vccmv = 3300;
+/* The battery voltage in mV, corrected with the measured supply voltage */
+uint16_t batmv = 0;
+/* Temperature of the MCU in degrees celsius (roughly) */
+int8_t mcutemp = 0;
+/* How often did we send a packet? This survives a warm restart, the
+ * inverted copy tells us whether it is still valid. */
+uint32_t pktssent __attribute__((section(".noinit")));
+static uint32_t pktssentinv __attribute__((section(".noinit")));
+/* Geigercounter values of the first tube, as sent in the last 0xf9 frame */
 uint32_t geigcntavg1min = 0;
 uint32_t geigcntavg60min = 0;
 
@@ -34,31 +49,132 @@ uint32_t geigcntavg60min = 0;
  * on Boot */
 uint8_t sensorid = 3; // 0 - 255 / 0xff
 
-/* The frame we're preparing to send. */
-static uint8_t frametosend[12];
+/* The settings that can be changed at runtime. These are the defaults
+ * that are used if there are no valid settings in the EEPROM. */
+static const struct settings defaultsettings PROGMEM = {
+  .version = SETTINGSVERSION,
+  .txinterval = 5, /* 5 ticks = 30 s */
+  .rfmfreq = 868300UL,
+  .rfmdatarate = 17241UL,
+  .rfmpower = 31,
+  .avgwinshort = 60, /* 1 minute */
+  .avgwinlong = 60 * 60, /* 60 minutes */
+  .alarmcpm = 0,
+  .bucketms = GEIGER_BUCKETMS,
+  .txavg = 0, /* windowed averages */
+  .viuncert = 0, /* off */
+  .vimintime = 10,
+  .vimaxtime = 10 * 60,
+  .txformat = 0, /* the fixed frames that every receiver understands */
+  .rxevery = 0, /* no downlink */
+  .rxwindow = 10,
+  .txslot = 0, /* random */
+  .lbt = 0, /* off */
+  .txauto = 0,
+  .histupload = 0, /* on request only */
+  .tempoffset = 128, /* uncalibrated */
+};
+struct settings settings;
+/* Set by the console when settings have been changed. They then get applied
+ * and written to the EEPROM from the housekeeping task. */
+volatile uint8_t settingschanged = 0;
+
+/* Downlink commands: which settings they change. The limits are the same
+ * as those of the console. */
+struct downlinkdesc {
+  uint8_t cmd;
+  uint8_t offset;
+  uint8_t size;
+  uint32_t min;
+  uint32_t max;
+};
+static const struct downlinkdesc downlinkdescs[] PROGMEM = {
+  { DOWNLINK_CMD_TXINTERVAL, offsetof(struct settings, txinterval), 1, 1, 255 },
+  { DOWNLINK_CMD_RFMPOWER,   offsetof(struct settings, rfmpower),   1, 0, 31 },
+  { DOWNLINK_CMD_TXFORMAT,   offsetof(struct settings, txformat),   1, 0, 2 },
+  { DOWNLINK_CMD_TXAVG,      offsetof(struct settings, txavg),      1, 0, 2 },
+  { DOWNLINK_CMD_ALARMCPM,   offsetof(struct settings, alarmcpm),   4, 0, 0xffffffUL },
+  { DOWNLINK_CMD_RXEVERY,    offsetof(struct settings, rxevery),    1, 0, 255 },
+};
+#define NUMDOWNLINKDESCS (sizeof(downlinkdescs) / sizeof(downlinkdescs[0]))
+/* Set when the alarm threshold has been reached, so the next transmission
+ * gets a higher priority for the airtime budget. */
+static uint8_t alarmpending = 0;
+/* Transmissions that were postponed because the airtime budget ran low */
+uint16_t txdeferred = 0;
+/* How long the last transmission kept us busy, and the radio awake, in
+ * Timer3 ticks (128 us). Timer3 keeps running while adc_read() sleeps
+ * (idle sleep), so this includes waiting for the ADC. */
+uint16_t txawaketicks = 0;
+uint16_t txawakemax = 0;
+uint16_t txradioticks = 0;
+/* Listen before talk: how often we check the channel before sending
+ * anyways, and the random backoff between the checks in ms. */
+#define LBTMAXTRIES 5
+#define LBTMINBACKOFF 5
+#define LBTMAXBACKOFF 40
+/* How often the channel was busy (i.e. collisions avoided, and retries),
+ * and how often we gave up waiting and sent anyways. */
+uint16_t lbtbusy = 0;
+uint16_t lbtforced = 0;
+/* Slotted transmit timing: every unit transmits every txinterval ticks
+ * plus (sensorid % TXSLOTS) / CLOCK_HZ seconds, plus up to TXJITTER - 1
+ * clock units at random. So no two units (with IDs less than TXSLOTS
+ * apart) have the same period, and they drift past each other instead of
+ * colliding again and again. There is no common time base that would
+ * allow real slots. tools/slotsim.c compares this with the random mode. */
+#define TXSLOTS CLOCK_HZ
+#define TXJITTER 2
+/* Transmissions since we last listened for a command */
+static uint8_t txsincerx = 0;
+/* Statistics for the console */
+uint16_t dlaccepted = 0;
+uint16_t dlrejected = 0;
+/* History uploads that failed: the FIFO ran empty, or a timeout */
+uint16_t histfailed = 0;
+
+/* The frame we're preparing to send, and its length including the CRC.
+ * The fixed frames are 12 bytes, the TLV frames up to FRAMEMAXLEN. */
+#define FRAMEMAXLEN 32
+static uint8_t frametosend[FRAMEMAXLEN];
+static uint8_t frametosendlen;
+
+/* The content of MCUSR on boot, i.e. why we were reset. 0 if unknown
+ * (the bootloader might already have cleared it). This is in .noinit,
+ * because .bss is only cleared after .init3. */
+uint8_t resetcause __attribute__((section(".noinit")));
+/* Set if the geiger history survived the reset. */
+uint8_t warmstart = 0;
 
 /* We need to disable the watchdog very early, because it stays active
  * after a reset with a timeout of only 15 ms. */
 void dwdtonreset(void) __attribute__((naked)) __attribute__((section(".init3")));
 void dwdtonreset(void) {
+  resetcause = MCUSR;
   MCUSR = 0;
   wdt_disable();
 }
 
+static uint8_t crcupdate(uint8_t res, uint8_t val)
+{
+  uint8_t i;
+  for (i = 0; i < 8; i++) {
+    uint8_t tmp = (uint8_t)((res ^ val) & 0x80);
+    res <<= 1;
+    if (0 != tmp) {
+      res ^= 0x31;
+    }
+    val <<= 1;
+  }
+  return res;
+}
+
 static uint8_t calculatecrc(uint8_t * data, uint8_t len)
 {
-  uint8_t i, j;
+  uint8_t j;
   uint8_t res = 0;
   for (j = 0; j < len; j++) {
-    uint8_t val = data[j];
-    for (i = 0; i < 8; i++) {
-      uint8_t tmp = (uint8_t)((res ^ val) & 0x80);
-      res <<= 1;
-      if (0 != tmp) {
-        res ^= 0x31;
-      }
-      val <<= 1;
-    }
+    res = crcupdate(res, data[j]);
   }
   return res;
 }
@@ -81,21 +197,406 @@ static uint8_t calculatecrc(uint8_t * data, uint8_t len)
  * Byte  9: CountsPerMinute for last 60 minutes, LSB
  * Byte 10: Battery voltage (0-255, 255 = 6.6V)
  * Byte 11: CRC
+ * With txavg set to 2, a second frame with sensortype 0xfb follows, which
+ * has the same layout but carries the exponential moving averages with
+ * 1 and 60 minutes time constant.
+ * Results of the variable integration time measurement are sent in a frame
+ * with sensortype 0xfc as soon as they are done:
+ * Byte  4-6: CountsPerMinute, MSB first
+ * Byte  7-8: Integration time in seconds, MSB first
+ * Byte  9: Relative uncertainty in 0.1% (255 = 25.5% or more)
+ * Byte 10: Battery voltage (0-255, 255 = 6.6V)
+ * With more than one tube, every counter (see geiger.h) sends its own
+ * 0xf9 and 0xfb frames, with sensorid + the number of the counter as ID.
+ * The coincidences are the last counter.
  */
-void prepareframe(void)
+void prepareframe(uint8_t id, uint8_t type, uint32_t avgshort, uint32_t avglong)
 {
   frametosend[ 0] = 0xCC;
-  frametosend[ 1] = sensorid;
+  frametosend[ 1] = id;
   frametosend[ 2] = 8; /* 8 bytes of data follow (CRC not counted) */
-  frametosend[ 3] = 0xf9; /* Sensor type: FoxGeig */
-  frametosend[ 4] = (geigcntavg1min >> 16) & 0xff;
-  frametosend[ 5] = (geigcntavg1min >>  8) & 0xff;
-  frametosend[ 6] = (geigcntavg1min >>  0) & 0xff;
-  frametosend[ 7] = (geigcntavg60min >> 16) & 0xff;
-  frametosend[ 8] = (geigcntavg60min >>  8) & 0xff;
-  frametosend[ 9] = (geigcntavg60min >>  0) & 0xff;
-  frametosend[10] = batvolt >> 2;
+  frametosend[ 3] = type; /* Sensor type: FoxGeig */
+  frametosend[ 4] = (avgshort >> 16) & 0xff;
+  frametosend[ 5] = (avgshort >>  8) & 0xff;
+  frametosend[ 6] = (avgshort >>  0) & 0xff;
+  frametosend[ 7] = (avglong >> 16) & 0xff;
+  frametosend[ 8] = (avglong >>  8) & 0xff;
+  frametosend[ 9] = (avglong >>  0) & 0xff;
+  uint32_t batscaled = ((uint32_t)batmv * 255UL) / 6600UL;
+  frametosend[10] = (batscaled > 255) ? 255 : batscaled;
   frametosend[11] = calculatecrc(frametosend, 11);
+  frametosendlen = 12;
+}
+
+/* The TLV frame (sensortype 0xfa) has a variable length:
+ * Byte  0: Startbyte (=0xCC)
+ * Byte  1: Sensor-ID (sensorid + the number of the counter)
+ * Byte  2: Number of data bytes that follow (CRC not counted)
+ * Byte  3: Sensortype (=0xfa)
+ * Byte  4: Format version (=1)
+ * Byte  5: Fields, each one tag byte, one length byte and the value
+ *          (MSB first), see tlvfields below
+ * Last byte: CRC
+ * Only the fields whose value changed since they were last sent are
+ * included, and the sequence number. Every TLVFULLEVERY frames, all fields
+ * are sent again, so a receiver that missed something catches up. Fields
+ * that do not fit into the frame are sent with the next one. Receivers
+ * skip tags they do not know, so new fields can be added to the end of
+ * the table any time - but tags must never be reused, and there can be at
+ * most 16 fields (tlvpending has one bit per field). */
+#define TLVVERSION 1
+#define TLVFULLEVERY 10
+#define TLV_ALWAYS 0x01 /* always sent, changed or not */
+#define TLV_DEVICE 0x02 /* not per counter, only in the frame of counter 0 */
+struct tlvfield {
+  uint8_t tag;
+  uint8_t size;  /* in bytes, 1-4 */
+  uint8_t flags;
+  uint32_t (*get)(uint8_t ch);
+};
+static uint32_t tlv_seq(uint8_t ch) { return pktssent; }
+static uint32_t tlv_cpmshort(uint8_t ch) { return geiger_getavgsecs(ch, settings.avgwinshort); }
+static uint32_t tlv_cpmlong(uint8_t ch) { return geiger_getavgsecs(ch, settings.avgwinlong); }
+static uint32_t tlv_ewma1min(uint8_t ch) { return geiger_getewma(ch, GEIGER_EWMA1MIN, NULL); }
+static uint32_t tlv_ewma60min(uint8_t ch) { return geiger_getewma(ch, GEIGER_EWMA60MIN, NULL); }
+static uint32_t tlv_batmv(uint8_t ch) { return batmv; }
+static uint32_t tlv_vccmv(uint8_t ch) { return vccmv; }
+static uint32_t tlv_mcutemp(uint8_t ch) { return (uint8_t)mcutemp; }
+static uint32_t tlv_uptime(uint8_t ch) { return clock_uptime(); }
+static uint32_t tlv_resetcause(uint8_t ch) { return resetcause; }
+static uint32_t tlv_stackunused(uint8_t ch) { return sysmon_stackunused(); }
+static const struct tlvfield tlvfields[] PROGMEM = {
+  { 0x01, 2, TLV_ALWAYS | TLV_DEVICE, tlv_seq }, /* packet sequence number */
+  { 0x02, 3, 0, tlv_cpmshort },                  /* CPM, short window (0xffffff = invalid) */
+  { 0x03, 3, 0, tlv_cpmlong },                   /* CPM, long window */
+  { 0x04, 3, 0, tlv_ewma1min },                  /* CPM, 1 min moving average */
+  { 0x05, 3, 0, tlv_ewma60min },                 /* CPM, 60 min moving average */
+  { 0x06, 2, TLV_DEVICE, tlv_batmv },            /* battery voltage in mV */
+  { 0x07, 2, TLV_DEVICE, tlv_vccmv },            /* supply voltage in mV */
+  { 0x08, 1, TLV_DEVICE, tlv_mcutemp },          /* chip temperature, signed */
+  { 0x09, 4, TLV_DEVICE, tlv_uptime },           /* uptime in seconds */
+  { 0x0a, 1, TLV_DEVICE, tlv_resetcause },       /* MCUSR at the last reset */
+  { 0x0b, 2, TLV_DEVICE, tlv_stackunused },      /* stack never used, in bytes */
+};
+#define NUMTLVFIELDS (sizeof(tlvfields) / sizeof(tlvfields[0]))
+/* What we sent last, and what still needs to be sent (one bit per field) */
+static uint32_t tlvlast[GEIGER_NUMCOUNTERS][NUMTLVFIELDS];
+static uint16_t tlvpending[GEIGER_NUMCOUNTERS];
+static uint8_t tlvframes[GEIGER_NUMCOUNTERS];
+
+/* Fill the frame to send with a TLV frame for counter ch. Returns 0 if
+ * there is nothing to send (which can only happen for ch > 0). */
+static uint8_t preparetlvframe(uint8_t ch)
+{
+  uint8_t len = 5;
+  if (tlvframes[ch] == 0) { /* Time to send everything again */
+    tlvpending[ch] = 0xffff;
+  }
+  tlvframes[ch] = (tlvframes[ch] + 1) % TLVFULLEVERY;
+  for (uint8_t i = 0; i < NUMTLVFIELDS; i++) {
+    struct tlvfield f;
+    uint32_t v;
+    memcpy_P(&f, &tlvfields[i], sizeof(f));
+    if ((f.flags & TLV_DEVICE) && (ch != 0)) {
+      continue;
+    }
+    v = f.get(ch);
+    if (v != tlvlast[ch][i]) {
+      tlvpending[ch] |= (uint16_t)1 << i;
+    }
+    if (!(f.flags & TLV_ALWAYS) && !(tlvpending[ch] & ((uint16_t)1 << i))) {
+      continue;
+    }
+    if ((len + 2 + f.size) > (FRAMEMAXLEN - 1)) {
+      continue; /* No room left, this one goes with the next frame */
+    }
+    frametosend[len++] = f.tag;
+    frametosend[len++] = f.size;
+    for (uint8_t b = f.size; b > 0; b--) {
+      frametosend[len++] = (v >> ((b - 1) * 8)) & 0xff;
+    }
+    tlvlast[ch][i] = v;
+    tlvpending[ch] &= (uint16_t)~((uint16_t)1 << i);
+  }
+  if (len == 5) {
+    return 0;
+  }
+  frametosend[0] = 0xCC;
+  frametosend[1] = sensorid + ch;
+  frametosend[2] = len - 3; /* data bytes that follow (CRC not counted) */
+  frametosend[3] = 0xfa; /* Sensor type: FoxGeig TLV */
+  frametosend[4] = TLVVERSION;
+  frametosend[len] = calculatecrc(frametosend, len);
+  frametosendlen = len + 1;
+  return 1;
+}
+
+/* Wait until nobody else is transmitting, with random backoff. Returns
+ * 0 if the channel stayed busy. The RFM69 needs to be awake, unless it
+ * sends by itself (txauto). During the backoff both the RFM69 and we
+ * sleep: waking the RFM69 again takes less than a ms. */
+static uint8_t waitforclearchannel(void)
+{
+  for (uint8_t i = 0; i < LBTMAXTRIES; i++) {
+    uint8_t backoff;
+    /* The RSSI is -2 * dBm, so smaller values mean stronger signals */
+    if (rfm69_readrssi() >= (settings.lbt * 2)) {
+      return 1;
+    }
+    lbtbusy++;
+    backoff = LBTMINBACKOFF + prng_below(LBTMAXBACKOFF - LBTMINBACKOFF + 1);
+    rfm69_setsleep(1);
+    clock_sleepticks(((uint16_t)backoff * 125) / 16); /* 128 us ticks */
+    if (!settings.txauto) {
+      rfm69_setsleep(0);
+    }
+  }
+  return 0;
+}
+
+/* Send frametosend, if the airtime budget allows it at priority prio.
+ * Returns 1 if it was sent. The RFM69 needs to be awake,
+ * unless it sends by itself (txauto). */
+static uint8_t sendframe(uint8_t prio)
+{
+  if (!airtime_allow(prio, airtime_estimate(frametosendlen, settings.rfmdatarate))) {
+    console_printpgm_P(PSTR(" NOAIR "));
+    return 0;
+  }
+  if ((settings.lbt > 0) && !waitforclearchannel()) {
+    lbtforced++;
+  }
+  airtime_add(rfm69_sendarray(frametosend, frametosendlen));
+  pktssent++;
+  pktssentinv = ~pktssent;
+  return 1;
+}
+
+/* History upload: The geiger history of one counter, as one long frame
+ * that is streamed through the FIFO (rfm69_sendstream()). So a receiver
+ * that missed some frames can fill the gaps.
+ * Byte  0: Startbyte (=0xCC)
+ * Byte  1: Sensor-ID (plus the counter, like the other frames)
+ * Byte  2: Number of data bytes that follow (without the CRC)
+ * Byte  3: Sensor type (=0xfd for FoxGeig history)
+ * Byte  4: HISTVERSION
+ * Byte  5-6: Number of the newest bucket in the frame, MSB first
+ * Byte  7-8: Length of a bucket in 1/64 s, MSB first
+ * Byte  9: Number of buckets n
+ * Byte 10-: The buckets, oldest first, compressed into nibbles (high
+ *           nibble first): 0x0-0xE is the difference to the previous
+ *           bucket, zigzag coded (0, -1, +1, -2, ... +7). 0xF is followed
+ *           by 4 nibbles with the value (MSB first, 0xffff = no data).
+ *           The previous bucket is 0 at the start, and buckets without
+ *           data do not change it. A last unused nibble is 0.
+ * Last byte: CRC
+ */
+#define HISTVERSION 1
+#define HISTHEADERLEN 10
+#define HISTMAXLEN 255
+struct histenc {
+  uint8_t ch;
+  uint16_t bucket;  /* the next bucket to encode */
+  uint16_t end;     /* the bucket after the last one */
+  uint16_t prev;
+  uint8_t nib[6];   /* nibbles not sent yet */
+  uint8_t nnib;
+};
+/* The upload in progress */
+static struct histenc hu;
+static uint8_t huheader[HISTHEADERLEN];
+static uint8_t hupos;
+static uint8_t hulen;
+static uint8_t hucrc;
+/* The newest buckets, newest first. Their block may still be rescaled when
+ * the next bucket ends (see geiger.c), so we encode them from this copy. */
+static uint16_t husnap[GEIGERHISTBLOCK];
+
+/* Value of bucket of counter ch, for an upload that ends with bucket last */
+static uint16_t histget(uint8_t ch, uint16_t bucket, uint16_t last)
+{
+  uint16_t age = last - bucket;
+  return (age < GEIGERHISTBLOCK) ? husnap[age] : geiger_gethistory(ch, bucket);
+}
+
+/* Encode the next bucket into e->nib */
+static void histencnext(struct histenc * e)
+{
+  uint16_t v = histget(e->ch, e->bucket++, e->end - 1);
+  int32_t d = (int32_t)v - e->prev;
+  if ((v != 0xffff) && (d >= -7) && (d <= 7)) {
+    e->nib[e->nnib++] = (d >= 0) ? (d * 2) : ((-d * 2) - 1);
+  } else {
+    e->nib[e->nnib++] = 0xf;
+    for (int8_t i = 12; i >= 0; i -= 4) {
+      e->nib[e->nnib++] = (v >> i) & 0x0f;
+    }
+  }
+  if (v != 0xffff) {
+    e->prev = v;
+  }
+}
+
+/* Number of bytes n buckets of counter ch up to bucket last need */
+static uint16_t histdatalen(uint8_t ch, uint16_t last, uint8_t n)
+{
+  struct histenc e = { ch, last - n + 1, last + 1, 0, { 0 }, 0 };
+  uint16_t nibbles = 0;
+  for (uint8_t i = 0; i < n; i++) {
+    histencnext(&e);
+    nibbles += e.nnib;
+    e.nnib = 0;
+  }
+  return (nibbles + 1) / 2;
+}
+
+/* Produce the next n bytes of the upload. Called by rfm69_sendstream()
+ * while the frame is already on air. */
+static void histfill(uint8_t * buf, uint8_t n)
+{
+  for (uint8_t i = 0; i < n; i++) {
+    uint8_t b;
+    if (hupos < HISTHEADERLEN) {
+      b = huheader[hupos];
+    } else if (hupos == (hulen - 1)) {
+      b = hucrc;
+    } else {
+      while ((hu.nnib < 2) && (hu.bucket != hu.end)) {
+        histencnext(&hu);
+      }
+      b = (hu.nib[0] << 4) | ((hu.nnib > 1) ? hu.nib[1] : 0);
+      hu.nnib = (hu.nnib > 1) ? (hu.nnib - 2) : 0;
+      for (uint8_t j = 0; j < hu.nnib; j++) {
+        hu.nib[j] = hu.nib[j + 2];
+      }
+    }
+    if (hupos < (hulen - 1)) {
+      hucrc = crcupdate(hucrc, b);
+    }
+    buf[i] = b;
+    hupos++;
+  }
+}
+
+/* Upload the history of counter ch. The RFM69 needs to be awake. */
+static void sendhistory(uint8_t ch)
+{
+  uint8_t ok;
+  uint16_t last;
+  uint16_t datalen;
+  /* Leave out the oldest block, which is cleared when the next bucket
+   * ends, maybe while we are sending (and no more than the header can
+   * count). */
+  uint8_t n = ((SIZEOFGEIGERHISTORY - GEIGERHISTBLOCK - 1) > 255) ? 255
+            : (SIZEOFGEIGERHISTORY - GEIGERHISTBLOCK - 1);
+  do { /* Again if a bucket ended meanwhile */
+    last = geiger_getbucketcount();
+    for (uint8_t i = 0; i < GEIGERHISTBLOCK; i++) {
+      husnap[i] = geiger_gethistory(ch, last - i);
+    }
+  } while (last != geiger_getbucketcount());
+  /* Skip the buckets that have no data yet */
+  while ((n > 0) && (histget(ch, last - n + 1, last) == 0xffff)) {
+    n--;
+  }
+  if (n == 0) {
+    return;
+  }
+  /* Drop the oldest buckets until it fits into one frame */
+  while ((datalen = histdatalen(ch, last, n)) > (HISTMAXLEN - HISTHEADERLEN - 1)) {
+    n -= (n / 8) + 1;
+  }
+  hulen = HISTHEADERLEN + datalen + 1;
+  huheader[0] = 0xCC;
+  huheader[1] = sensorid + ch;
+  huheader[2] = hulen - 4; /* data bytes that follow (CRC not counted) */
+  huheader[3] = 0xfd;
+  huheader[4] = HISTVERSION;
+  huheader[5] = (last >> 8) & 0xff;
+  huheader[6] = (last >> 0) & 0xff;
+  huheader[7] = (geiger_getbucketlen() >> 8) & 0xff;
+  huheader[8] = (geiger_getbucketlen() >> 0) & 0xff;
+  huheader[9] = n;
+  hu.ch = ch;
+  hu.bucket = last - n + 1;
+  hu.end = last + 1;
+  hu.prev = 0;
+  hu.nnib = 0;
+  hupos = 0;
+  hucrc = 0;
+  if (!airtime_allow(AIRTIME_PRIO_LOW, airtime_estimate(hulen, settings.rfmdatarate))) {
+    console_printpgm_P(PSTR(" NOAIR "));
+    return;
+  }
+  if ((settings.lbt > 0) && !waitforclearchannel()) {
+    lbtforced++;
+  }
+  airtime_add(rfm69_sendstream(hulen, histfill, &ok));
+  if (!ok) {
+    histfailed++;
+    return;
+  }
+  pktssent++;
+  pktssentinv = ~pktssent;
+}
+
+/* Listen for a downlink command for settings.rxwindow ms, and apply it.
+ * The RFM69 needs to be awake, unless it sends by itself (txauto). */
+static void listenfordownlink(void)
+{
+  uint8_t key[DOWNLINK_KEYLEN];
+  uint8_t pkt[DOWNLINK_LEN];
+  uint8_t haskey = 0;
+  struct downlinkcmd c;
+  eeprom_read_block(key, ee_downlinkkey, sizeof(key));
+  for (uint8_t i = 0; i < sizeof(key); i++) {
+    if (key[i] != 0xff) { haskey = 1; }
+  }
+  if (!haskey) { /* Without a key, anybody could configure us. */
+    return;
+  }
+  if (!rfm69_receive(pkt, DOWNLINK_LEN, settings.rxwindow)) {
+    return;
+  }
+  if (!downlink_parse(key, sensorid, eeprom_read_dword(&ee_downlinkcounter), pkt, &c)) {
+    dlrejected++;
+    return;
+  }
+  /* Even if we cannot apply it, this counter is used up now. */
+  eeprom_update_dword(&ee_downlinkcounter, c.counter);
+  if (c.cmd == DOWNLINK_CMD_HISTUPLOAD) {
+    dlaccepted++;
+    sched_wake(SCHED_TASK_HISTORY);
+    return;
+  }
+  for (uint8_t i = 0; i < NUMDOWNLINKDESCS; i++) {
+    if (pgm_read_byte(&downlinkdescs[i].cmd) != c.cmd) {
+      continue;
+    }
+    if ((c.value < pgm_read_dword(&downlinkdescs[i].min))
+     || (c.value > pgm_read_dword(&downlinkdescs[i].max))) {
+      break;
+    }
+    uint8_t * p = (uint8_t *)&settings + pgm_read_byte(&downlinkdescs[i].offset);
+    memcpy(p, &c.value, pgm_read_byte(&downlinkdescs[i].size));
+    console_printpgm_P(PSTR(" DL "));
+    dlaccepted++;
+    /* Applied and saved like changes from the console */
+    settingschanged = 1;
+    sched_wake(SCHED_TASK_HOUSEKEEPING);
+    return;
+  }
+  dlrejected++;
+}
+
+static uint16_t calculatesettingscrc(struct settings * s)
+{
+  uint16_t res = 0xffff;
+  uint8_t * p = (uint8_t *)s;
+  for (uint8_t i = 0; i < offsetof(struct settings, crc); i++) {
+    res = _crc16_update(res, p[i]);
+  }
+  return res;
 }
 
 void loadsettingsfromeeprom(void)
@@ -105,26 +606,249 @@ void loadsettingsfromeeprom(void)
   if ((e1 ^ 0xff) == e2) { /* OK, the 'checksum' matches. Use this as our ID */
     sensorid = e1;
   }
+  eeprom_read_block(&settings, &ee_settings, sizeof(settings));
+  if ((settings.version != SETTINGSVERSION)
+   || (settings.crc != calculatesettingscrc(&settings))) {
+    /* Nothing valid in the EEPROM, use our defaults. */
+    memcpy_P(&settings, &defaultsettings, sizeof(settings));
+  }
+}
+
+void savesettingstoeeprom(void)
+{
+  settings.version = SETTINGSVERSION;
+  settings.crc = calculatesettingscrc(&settings);
+  /* This only writes the bytes that actually changed, to spare the EEPROM. */
+  eeprom_update_block(&settings, &ee_settings, sizeof(settings));
+}
+
+/* Apply those settings that need to be pushed to the hardware. */
+void applysettings(void)
+{
+  rfm69_setfrequency(settings.rfmfreq);
+  rfm69_setdatarate(settings.rfmdatarate);
+  rfm69_setpower(settings.rfmpower);
+  rfm69_setautotx(settings.txauto);
+  geiger_setbucketms(settings.bucketms);
+  geiger_setvi(settings.viuncert, settings.vimintime, settings.vimaxtime);
+  if (settings.histupload > 0) {
+    sched_setinterval(SCHED_TASK_HISTORY, CLOCK_SECONDS(3600UL * settings.histupload));
+    sched_runin(SCHED_TASK_HISTORY, CLOCK_SECONDS(3600UL * settings.histupload));
+  } else {
+    sched_setinterval(SCHED_TASK_HISTORY, 0);
+    sched_stop(SCHED_TASK_HISTORY);
+  }
+  if (settings.viuncert > 0) {
+    sched_runin(SCHED_TASK_VARINT, CLOCK_SECONDS(1));
+  } else {
+    sched_stop(SCHED_TASK_VARINT);
+  }
+  /* The alarm check only needs to run if there is an alarm threshold */
+  if (settings.alarmcpm > 0) {
+    sched_runin(SCHED_TASK_SAMPLE, CLOCK_PERIOD);
+  } else {
+    sched_stop(SCHED_TASK_SAMPLE);
+  }
+}
+
+/* Check for alarm once per geiger tick: If the short average reaches the
+ * threshold, we don't wait for the transmit interval. */
+static void sampletask(void)
+{
+  for (uint8_t ch = 0; ch < GEIGER_NUMCHANNELS; ch++) {
+    uint32_t shortavg = geiger_getavgsecs(ch, settings.avgwinshort);
+    if ((shortavg != 0xffffff) && (shortavg >= settings.alarmcpm)) {
+      alarmpending = 1;
+      sched_runin(SCHED_TASK_TRANSMIT, 0);
+      return;
+    }
+  }
+}
+
+/* Update values and send */
+static void transmittask(void)
+{
+  uint8_t transmitinterval;
+  uint16_t awakestart, radiostart;
+  uint32_t avgshort[GEIGER_NUMCOUNTERS], avglong[GEIGER_NUMCOUNTERS];
+  uint32_t ewma1min[GEIGER_NUMCOUNTERS], ewma60min[GEIGER_NUMCOUNTERS];
+  /* The first frame has normal (or alarm) priority, all further ones are
+   * extras that are dropped first when the airtime gets scarce. */
+  uint8_t prio = (alarmpending) ? AIRTIME_PRIO_HIGH : AIRTIME_PRIO_NORMAL;
+  if (!airtime_allow(prio, airtime_estimate(FRAMEMAXLEN, settings.rfmdatarate))) {
+    /* Not even the first frame would be allowed. Try again next tick,
+     * by then the oldest slot of the budget may have expired. */
+    txdeferred++;
+    sched_runin(SCHED_TASK_TRANSMIT, CLOCK_PERIOD);
+    return;
+  }
+  alarmpending = 0;
+  awakestart = clock_getticks();
+  /* The measurements are a pipeline: The battery measurement takes the
+   * longest (4^BATOVERSAMPLE = 16 conversions), so start it first and get the averages
+   * while it runs. The RFM69 oscillator only needs up to a ms, so we
+   * start it last, and it comes up while we build and load the first
+   * frame. That way the radio is not drawing current for nothing while
+   * we wait for the ADC. */
+  adc_power(1);
+  adc_select(12);
+  adc_startoversampled(BATOVERSAMPLE);
+  for (uint8_t ch = 0; ch < GEIGER_NUMCOUNTERS; ch++) {
+    ewma1min[ch] = geiger_getewma(ch, GEIGER_EWMA1MIN, NULL);
+    ewma60min[ch] = geiger_getewma(ch, GEIGER_EWMA60MIN, NULL);
+    if (settings.txavg == 1) {
+      avgshort[ch] = ewma1min[ch];
+      avglong[ch] = ewma60min[ch];
+    } else {
+      avgshort[ch] = geiger_getavgsecs(ch, settings.avgwinshort);
+      avglong[ch] = geiger_getavgsecs(ch, settings.avgwinlong);
+    }
+  }
+  geigcntavg1min = avgshort[0];
+  geigcntavg60min = avglong[0];
+  /* Sleeps for the rest of the conversions */
+  batvolt = adc_read();
+  /* batvolt is relative to our supply voltage, so measure that too. */
+  vccmv = adc_readvcc();
+  {
+    int16_t t = (int16_t)adc_readtemperature() + settings.tempoffset - 128;
+    mcutemp = (t < -128) ? -128 : ((t > 127) ? 127 : t);
+  }
+  adc_power(0);
+  batmv = ((uint32_t)batvolt * 2UL * vccmv) / (1023UL << BATOVERSAMPLE);
+  /* SEND */
+  radiostart = clock_getticks();
+  if (!settings.txauto) {
+    rfm69_wakeup();  /* This mainly turns on the oscillator again */
+  }
+  console_printpgm_P(PSTR(" TX "));
+  for (uint8_t ch = 0; ch < GEIGER_NUMCOUNTERS; ch++) {
+    if (settings.txformat != 1) {
+      prepareframe(sensorid + ch, 0xf9, avgshort[ch], avglong[ch]);
+      sendframe(prio);
+      prio = AIRTIME_PRIO_LOW;
+      if (settings.txavg == 2) {
+        prepareframe(sensorid + ch, 0xfb, ewma1min[ch], ewma60min[ch]);
+        sendframe(AIRTIME_PRIO_LOW);
+      }
+    }
+    if (settings.txformat != 0) {
+      /* Check the budget before preparetlvframe() marks the fields as
+       * sent, so refused changes go out with the next frame. */
+      if (!airtime_allow(prio, airtime_estimate(FRAMEMAXLEN, settings.rfmdatarate))) {
+        console_printpgm_P(PSTR(" NOAIR "));
+      } else if (preparetlvframe(ch)) {
+        sendframe(prio);
+        prio = AIRTIME_PRIO_LOW;
+      }
+    }
+  }
+  if ((settings.rxevery > 0) && (++txsincerx >= settings.rxevery)) {
+    txsincerx = 0;
+    listenfordownlink();
+  }
+  rfm69_setsleep(1);
+  txradioticks = clock_ticksince(radiostart);
+  txawaketicks = clock_ticksince(awakestart);
+  if (txawaketicks > txawakemax) {
+    txawakemax = txawaketicks;
+  }
+  /* The lower bits of the ADC readings are noise, and so is the timing of
+   * the geiger pulses. */
+  prng_stir(((uint16_t)geiger_getentropy() << 8) ^ batvolt ^ ((uint16_t)mcutemp << 4));
+  transmitinterval = settings.txinterval;
+  if (settings.txslot) {
+    sched_runin(SCHED_TASK_TRANSMIT, (transmitinterval * CLOCK_PERIOD)
+                + (sensorid % TXSLOTS) + prng_below(TXJITTER));
+    return;
+  }
+  uint8_t rnd = prng_below(4);
+  if ((rnd == 3) && (transmitinterval < 255)) {
+    transmitinterval++;
+  } else if ((rnd == 0) && (transmitinterval > 1)) {
+    transmitinterval--;
+  } /* else (1 or 2): no change */
+  sched_runin(SCHED_TASK_TRANSMIT, transmitinterval * CLOCK_PERIOD);
+}
+
+/* Check whether the variable integration time measurement is done, and
+ * send the result right away if it is. */
+static void varinttask(void)
+{
+  struct geigerviresult vi;
+  if (!geiger_viwork() || !geiger_getvi(&vi)) {
+    return;
+  }
+  /* Same layout as the other frames, so only the middle differs. */
+  prepareframe(sensorid, 0xfc, vi.cpm, 0);
+  frametosend[7] = (vi.secs >> 8) & 0xff;
+  frametosend[8] = (vi.secs >> 0) & 0xff;
+  frametosend[9] = (vi.uncert > 255) ? 255 : vi.uncert;
+  frametosend[11] = calculatecrc(frametosend, 11);
+  console_printpgm_P(PSTR(" VI "));
+  if (!settings.txauto) {
+    rfm69_setsleep(0);
+  }
+  sendframe(AIRTIME_PRIO_NORMAL);
+  rfm69_setsleep(1);
+}
+
+/* Upload the history of all counters, see sendhistory() */
+static void historytask(void)
+{
+  console_printpgm_P(PSTR(" HIST "));
+  /* With txauto the RFM69 stays asleep until rfm69_sendstream() wakes it */
+  if (!settings.txauto) {
+    rfm69_setsleep(0);
+  }
+  for (uint8_t ch = 0; ch < GEIGER_NUMCOUNTERS; ch++) {
+    sendhistory(ch);
+  }
+  rfm69_setsleep(1);
+}
+
+static void housekeepingtask(void)
+{
+  geiger_journalwork();
+  if (settingschanged) {
+    settingschanged = 0;
+    applysettings();
+    savesettingstoeeprom();
+  }
 }
 
 int main(void)
 {
-  uint16_t lastts = 0xf000; /* This forces an update immediately after start */
-  uint16_t curts;
-  uint16_t tsdiff;
-  uint8_t transmitinterval = 5; /* Transmitinterval in ticks of 6s, so 5 = 30s */
-  
   /* Initialize stuff */
   
   loadsettingsfromeeprom();
   
+  sysmon_init();
   console_init();
   adc_init();
-  geiger_init();
+  clock_init();
+  warmstart = geiger_init(resetcause, settings.bucketms);
+  if ((warmstart == 0) || (pktssent != ~pktssentinv)) {
+    pktssent = 0;
+    pktssentinv = ~pktssent;
+  }
   rfm69_initport();
   /* The RFM69 needs some time to start up (5 ms according to data sheet, we wait 10 to be sure) */
   _delay_ms(10);
   rfm69_initchip();
+  /* Send the first packet immediately after start */
+  sched_settask(SCHED_TASK_TRANSMIT, transmittask, 0);
+  sched_settask(SCHED_TASK_SAMPLE, sampletask, CLOCK_PERIOD);
+  sched_settask(SCHED_TASK_HOUSEKEEPING, housekeepingtask, CLOCK_PERIOD);
+  /* The console only runs when woken by USB events: the VBUS transition
+   * interrupt (EVENT_USB_Device_Connect/Disconnect, also enabled while USB
+   * is shut down) and the Start Of Frame while connected, see console.c.
+   * It runs once right at the start, for a cable that is already there. */
+  sched_settask(SCHED_TASK_CONSOLE, console_work, 0);
+  sched_settask(SCHED_TASK_VARINT, varinttask, CLOCK_SECONDS(1));
+  /* Only runs on request, or every histupload hours (see applysettings) */
+  sched_settask(SCHED_TASK_HISTORY, historytask, 0);
+  applysettings();
   rfm69_setsleep(1);
   
   /* Enable watchdog timer with a timeout of 8 seconds */
@@ -137,7 +861,11 @@ int main(void)
   DDRE &= (uint8_t)~_BV(PE6);
   /* Turn off unused stuff on the AVR via PRR registers */
   /* We don't use TWI/I2C and Timer0/1 */
-  PRR0 |= _BV(PRTWI) | _BV(PRTIM0) | _BV(PRTIM1);
+  PRR0 |= _BV(PRTWI) | _BV(PRTIM0);
+#if !defined(SYSMON_CLITIMING)
+  /* (unless Timer1 is used for timing the sections with IRQs disabled) */
+  PRR0 |= _BV(PRTIM1);
+#endif /* SYSMON_CLITIMING */
   /* We don't use Timer4 and the USART. There seems to be a bug in
    * avr-libc on Ubuntu 16.04, it doesn't define PRTIM4 but instead
    * PRTIM2 for a nonexistant Timer2. Therefore we cannot use the
@@ -156,43 +884,13 @@ int main(void)
   PORTC &= (uint8_t)~_BV(PC7); /* Turn it off */
 
   while (1) {
-    wdt_reset();
-    curts = geiger_getticks();
-    tsdiff = curts - lastts;
-    if (tsdiff >= transmitinterval) {
-      /* Time to update values and send */
-      adc_power(1);
-      adc_select(12);
-      adc_start();
-      geigcntavg1min = geiger_get1minavg();
-      geigcntavg60min = geiger_get60minavg();
-      batvolt = adc_read();
-      adc_power(0);
-      /* SEND */
-      rfm69_setsleep(0);  /* This mainly turns on the oscillator again */
-      prepareframe();
-      console_printpgm_P(PSTR(" TX "));
-      rfm69_sendarray(frametosend, 12);
-      rfm69_setsleep(1);
-      pktssent++;
-      lastts = curts; /* Remember when we last sent a packet */
-      /* We use the lower two bits of batvolt as the random noise that it is */
-      uint8_t rnd = batvolt & 3;
-      if (rnd == 3) {
-        transmitinterval = 6;
-      } else if (rnd == 0) {
-        transmitinterval = 4;
-      } else { /* 1 or 2 */
-        transmitinterval = 5;
-      }
-    }
-    console_work();
-    if (!console_isusbconfigured()) {
-      /* Don't go to sleep when USB is configured. Because then there is no
-       * lack of power, and more importantly, we want the console to feel
-       * "snappy" and we can't get that if we sleep for 6 seconds. */
-      wdt_reset(); /* Buy us 8 seconds time because the next IRQ might only arrive in 6 seconds */
-      sleep_cpu(); /* Go to sleep until the next IRQ arrives */
-    }
+    /* Run whatever is due. When USB is configured, the USB Start Of Frame
+     * interrupt wakes the console task every millisecond, so the console
+     * still feels "snappy". */
+    sched_run();
+    wdt_reset(); /* Buy us 8 seconds time */
+    /* Sleep until the next IRQ arrives. The timer wakes us at least every
+     * 6 seconds, in time for the watchdog. */
+    sched_sleep();
   }
 }
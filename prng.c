@@ -0,0 +1,31 @@
+/* $Id: prng.c $
+ * xorshift32 PRNG, see prng.h
+ */
+
+#include <stdint.h>
+#include "prng.h"
+
+static uint32_t state = 0x2545F491UL;
+
+void prng_stir(uint16_t noise)
+{
+  state ^= ((uint32_t)noise << 16) | noise;
+  if (state == 0) { /* The one state xorshift never leaves */
+    state = 0x2545F491UL;
+  }
+  prng_next();
+}
+
+uint32_t prng_next(void)
+{
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+uint16_t prng_below(uint16_t n)
+{
+  /* The slight bias of this does not matter for us. */
+  return (uint16_t)((prng_next() >> 16) % n);
+}
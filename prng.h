@@ -0,0 +1,18 @@
+/* $Id: prng.h $
+ * A small pseudo random number generator (xorshift32), used for the
+ * transmit jitter. It gets stirred with real noise (ADC, geiger pulse
+ * timing) whenever we have some, so units that were switched on at the
+ * same time still end up with different sequences.
+ */
+
+#ifndef _PRNG_H_
+#define _PRNG_H_
+
+/* Mix some noise into the state. */
+void prng_stir(uint16_t noise);
+/* The next pseudo random number */
+uint32_t prng_next(void);
+/* A pseudo random number from 0 to n - 1 (n > 0) */
+uint16_t prng_below(uint16_t n);
+
+#endif /* _PRNG_H_ */
@@ -8,7 +8,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
-#include <math.h>
+#include "clock.h"
 #include "rfm69.h"
 #include "lufa/console.h"
 
@@ -31,9 +31,45 @@
 #define RFMPIN_OURSS PB0
 
 #define RFM_FREQUENCY 868300UL
-#define RFM_DATARATE 17241.0
+#define RFM_DATARATE 17241UL
 
 #define PAYLOADSIZE 64
+/* The FIFO holds 66 bytes. When streaming, we refill it in chunks of
+ * STREAMCHUNK bytes whenever it has no more than STREAMTHRESH bytes left,
+ * i.e. when FifoLevel is clear. */
+#define FIFOSIZE 66
+#define STREAMTHRESH 32
+#define STREAMCHUNK 33
+
+/* Shadow copies of the configuration registers 0x00-0x3f: everything we
+ * write there is remembered, so changing a few bits (mostly the mode in
+ * RegOpMode) is a single write instead of a read and a write. shadowvalid
+ * has a bit for every register that has been written since the reset.
+ * Registers that change by themselves are never shadowed. */
+#define SHADOWSIZE 0x40
+static uint8_t shadow[SHADOWSIZE];
+static uint8_t shadowvalid[SHADOWSIZE / 8];
+
+/* RegOpMode modes */
+#define MODE_SLEEP   0x00
+#define MODE_STANDBY 0x04
+#define MODE_TX      0x0C
+#define MODE_RX      0x10
+
+/* Transmitting with AutoModes (see rfm69_setautotx()): autotxbusy is set
+ * while such a transmission may still be running, since autotxstart (in
+ * timer ticks), for at most autotxticks. Any register write has to wait
+ * for that first, so it does not disturb the transmission. */
+static uint8_t autotx = 0;
+static uint8_t autotxbusy = 0;
+static uint16_t autotxstart;
+static uint16_t autotxticks;
+
+/* Set by rfm69_wakeup() while the oscillator may still be starting. */
+static uint8_t waking = 0;
+
+/* The datarate currently set, needed for the RX timeouts. */
+static uint32_t curdatarate = RFM_DATARATE;
 
 ISR(INT6_vect)
 {
@@ -45,35 +81,137 @@ ISR(SPI_STC_vect)
   /* Nothing to do here. */
 }
 
+/* NSS timing: The RFM69 needs 30 ns setup time from NSS low to the first
+ * SCK edge, 20 ns hold time from the last SCK edge to NSS high, and NSS
+ * must stay high for 20 ns between accesses. One CPU cycle is 125 ns at
+ * 8 MHz, and there is always at least one instruction between changing NSS
+ * and starting or finishing a transfer, so we need no delays at all. */
+static inline void rfm69_select(void) {
+  RFMPORT &= (uint8_t)~_BV(RFMPIN_SS);
+}
+
+static inline void rfm69_deselect(void) {
+  RFMPORT |= _BV(RFMPIN_SS);
+}
+
 /* Note: Internal use only. Does not set the SS pin, the calling function
  * has to do that! */
 static uint8_t rfm69_spi8(uint8_t value) {
   SPDR = value;
-  /* busy-wait for transmission. this loop spins 4 usec with a 2 MHz SPI clock */
+  /* busy-wait for transmission. With a 4 MHz SPI clock this is 16 CPU
+   * cycles, so an interrupt would not be any faster. */
   while (!(SPSR & _BV(SPIF))) { }
 
   return SPDR;
 }
 
-uint16_t rfm69_spi16(uint16_t value) {
-  _delay_us(1);
-  RFMPORT &= (uint8_t)~_BV(RFMPIN_SS);
-  _delay_us(1);
-  uint16_t reply = rfm69_spi8(value >> 8) << 8;
-  reply |= rfm69_spi8(value & 0xff);
-  _delay_us(1);
-  RFMPORT |= _BV(RFMPIN_SS);
-  _delay_us(1);
-  
-  return reply;
+uint8_t rfm69_readreg(uint8_t reg) {
+  uint8_t res;
+  rfm69_select();
+  rfm69_spi8(reg & 0x7f);
+  res = rfm69_spi8(0x00);
+  rfm69_deselect();
+  return res;
 }
 
-uint8_t rfm69_readreg(uint8_t reg) {
-  return rfm69_spi16(((uint16_t)(reg & 0x7f) << 8) | 0x00) & 0xff;
+void rfm69_readburst(uint8_t reg, uint8_t * data, uint8_t len) {
+  rfm69_select();
+  rfm69_spi8(reg & 0x7f);
+  for (uint8_t i = 0; i < len; i++) {
+    data[i] = rfm69_spi8(0x00);
+  }
+  rfm69_deselect();
+}
+
+/* Can reg be shadowed? Not the FIFO, and not those with status bits. */
+static uint8_t isshadowed(uint8_t reg) {
+  return (reg < SHADOWSIZE) && (reg != 0x00) && (reg != 0x0A) && (reg != 0x23)
+      && (reg != 0x24) && (reg != 0x27) && (reg != 0x28);
+}
+
+static void setshadow(uint8_t reg, uint8_t val) {
+  if (isshadowed(reg)) {
+    shadow[reg] = val;
+    shadowvalid[reg >> 3] |= _BV(reg & 7);
+  }
+}
+
+static void rfm69_writereg(uint8_t reg, uint8_t val);
+
+/* Wait until an automatic transmission has finished for sure, and turn
+ * AutoModes off again. */
+static void rfm69_waitautotx(void) {
+  if (!autotxbusy) {
+    return;
+  }
+  autotxbusy = 0;
+  while (clock_ticksince(autotxstart) < autotxticks) { }
+  rfm69_writereg(0x3B, 0x00); /* RegAutoModes -> off */
 }
 
 static void rfm69_writereg(uint8_t reg, uint8_t val) {
-  rfm69_spi16(((uint16_t)(reg | 0x80) << 8) | val);
+  rfm69_waitautotx();
+  rfm69_select();
+  rfm69_spi8(reg | 0x80);
+  rfm69_spi8(val);
+  rfm69_deselect();
+  setshadow(reg, val);
+}
+
+void rfm69_writeburst(uint8_t reg, const uint8_t * data, uint8_t len) {
+  rfm69_waitautotx();
+  rfm69_select();
+  rfm69_spi8(reg | 0x80);
+  for (uint8_t i = 0; i < len; i++) {
+    rfm69_spi8(data[i]);
+  }
+  rfm69_deselect();
+  if (reg != 0x00) { /* All but the FIFO auto-increment the address */
+    for (uint8_t i = 0; i < len; i++) {
+      setshadow(reg + i, data[i]);
+    }
+  }
+}
+
+uint8_t rfm69_readregcached(uint8_t reg) {
+  if (isshadowed(reg) && (shadowvalid[reg >> 3] & _BV(reg & 7))) {
+    return shadow[reg];
+  }
+  return rfm69_readreg(reg);
+}
+
+int16_t rfm69_checkshadow(uint8_t from) {
+  for (uint8_t reg = from; reg < SHADOWSIZE; reg++) {
+    if ((shadowvalid[reg >> 3] & _BV(reg & 7)) && (rfm69_readreg(reg) != shadow[reg])) {
+      return reg;
+    }
+  }
+  return -1;
+}
+
+/* Change the mode in RegOpMode, keeping the other bits. Nothing is
+ * written if we are in that mode already. Leaving standby for RX or TX
+ * first waits for the oscillator if rfm69_wakeup() just started it. */
+static void rfm69_setmode(uint8_t mode) {
+  if (mode == MODE_SLEEP) {
+    waking = 0;
+  } else {
+    rfm69_waitready();
+  }
+  if ((shadow[0x01] & 0x1C) == mode) {
+    return;
+  }
+  rfm69_writereg(0x01, (shadow[0x01] & 0xE3) | mode);
+}
+
+/* How long sending length bytes takes in us, including preamble, sync
+ * word and about 1 ms for starting the oscillator and the transmitter. */
+static uint32_t txtimeus(uint8_t length) {
+  return ((((uint32_t)length + 5) * 8UL * 1000000UL) / curdatarate) + 1000UL;
+}
+
+void rfm69_setautotx(uint8_t on) {
+  autotx = on;
 }
 
 void rfm69_clearfifo(void) {
@@ -84,46 +222,75 @@ void rfm69_clearfifo(void) {
 
 void rfm69_settransmitter(uint8_t e) {
   if (e) {
-    /* RegOpMode => TRANSMIT */
-    rfm69_writereg(0x01, (rfm69_readreg(0x01) & 0xE3) | 0x0C);
+    rfm69_setmode(MODE_TX);
   } else {
-    /* RegOpMode => STANDBY */
-    rfm69_writereg(0x01, (rfm69_readreg(0x01) & 0xE3) | 0x04);
+    rfm69_setmode(MODE_STANDBY);
   }
 }
 
+void rfm69_wakeup(void) {
+  rfm69_setmode(MODE_STANDBY);
+  waking = 1;
+}
+
+void rfm69_waitready(void) {
+  if (!waking) {
+    return;
+  }
+  /* ModeReady is only available on DIO5, which is not connected, so we
+   * have to poll it. */
+  while (!(rfm69_readreg(0x27) & 0x80)) { /* Wait until ready */ }
+  waking = 0;
+}
+
 void rfm69_setsleep(uint8_t s) {
   if (s) {
-    /* RegOpMode => SLEEP */
-    rfm69_writereg(0x01, (rfm69_readreg(0x01) & 0xE3) | 0x00);
+    rfm69_setmode(MODE_SLEEP);
   } else {
-    /* RegOpMode => STANDBY */
-    rfm69_writereg(0x01, (rfm69_readreg(0x01) & 0xE3) | 0x04);
-    while (!(rfm69_readreg(0x27) & 0x80)) { /* Wait until ready */ }
+    rfm69_wakeup();
+    rfm69_waitready();
   }
 }
 
-void rfm69_sendarray(uint8_t * data, uint8_t length) {
+uint16_t rfm69_sendarray(uint8_t * data, uint8_t length) {
+  uint16_t start;
+  uint32_t maxreps;
+  if (autotx) {
+    /* The RFM69 does everything by itself: We stay in sleep mode, and
+     * AutoModes switches to TX as soon as the whole frame is in the FIFO
+     * (FifoLevel, i.e. more than length - 1 bytes), and back to sleep
+     * when it has been sent (PacketSent). */
+    uint32_t us = txtimeus(length);
+    rfm69_setmode(MODE_SLEEP);
+    if (rfm69_readregcached(0x38) != length) {
+      rfm69_writereg(0x38, length); /* RegPayloadLength */
+    }
+    if (rfm69_readregcached(0x3C) != (0x80 | (length - 1))) {
+      rfm69_writereg(0x3C, 0x80 | (length - 1)); /* RegFifoThresh */
+    }
+    rfm69_clearfifo();
+    /* RegAutoModes -> enter on FifoLevel, exit on PacketSent, intermediate mode TX */
+    rfm69_writereg(0x3B, 0x5B);
+    start = clock_getticks();
+    rfm69_writeburst(0x00, data, length);
+    autotxstart = start;
+    autotxticks = (us / 128UL) + 2;
+    autotxbusy = 1;
+    return (us + 999UL) / 1000UL;
+  }
   /* Set the length of our payload */
   rfm69_writereg(0x38, length);
   rfm69_clearfifo(); /* Clear the FIFO */
-  /* Now fill the FIFO. We manually set SS and use spi8 because this
-   * is the only "register" that is larger than 8 bits. */
-  _delay_us(1);
-  RFMPORT &= (uint8_t)~_BV(RFMPIN_SS);
-  _delay_us(1);
-  rfm69_spi8(0x80); /* Select RegFifo (0x00) for writing (|0x80) */
-  for (int i = 0; i < length; i++) {
-    rfm69_spi8(data[i]);
-  }
-  _delay_us(1);
-  RFMPORT |= _BV(RFMPIN_SS);
-  _delay_us(1);
+  /* Now fill the FIFO in one burst. */
+  rfm69_writeburst(0x00, data, length);
   /* FIFO has been filled. Tell the RFM69 to send by just turning on the transmitter. */
+  start = clock_getticks();
   rfm69_settransmitter(1);
-  /* Wait for transmission to finish, visible in RegIrqFlags2. */
+  /* Wait for transmission to finish, visible in RegIrqFlags2. Every
+   * register read takes at least 4 us, so one try per us of the expected
+   * time gives it four times as long as it should need. */
   uint8_t reg28 = 0x00;
-  uint16_t maxreps = 10000;
+  maxreps = txtimeus(length);
   while (!(reg28 & 0x08)) {
     reg28 = rfm69_readreg(0x28);
     maxreps--;
@@ -133,6 +300,148 @@ void rfm69_sendarray(uint8_t * data, uint8_t length) {
     }
   }
   rfm69_settransmitter(0);
+  /* Timer ticks are 128 us, and we may have missed up to one of them.
+   * Round up to ms. */
+  return ((((uint32_t)clock_ticksince(start) + 1) * 16UL) + 124UL) / 125UL;
+}
+
+uint16_t rfm69_sendstream(uint8_t length, void (*fill)(uint8_t * buf, uint8_t n), uint8_t * ok) {
+  uint8_t buf[STREAMCHUNK];
+  uint8_t sent = 0;
+  uint16_t start;
+  uint32_t maxreps = txtimeus(length);
+  rfm69_setsleep(0);
+  rfm69_writereg(0x38, length); /* RegPayloadLength */
+  /* RegFifoThresh: TxStartCondition FifoNotEmpty, FifoLevel above STREAMTHRESH */
+  rfm69_writereg(0x3C, 0x80 | STREAMTHRESH);
+  rfm69_clearfifo();
+  /* Fill the FIFO completely before we start */
+  while ((sent < length) && ((sent + STREAMCHUNK) <= FIFOSIZE)) {
+    uint8_t n = ((length - sent) < STREAMCHUNK) ? (length - sent) : STREAMCHUNK;
+    fill(buf, n);
+    rfm69_writeburst(0x00, buf, n);
+    sent += n;
+  }
+  *ok = 1;
+  start = clock_getticks();
+  rfm69_settransmitter(1);
+  /* Refill whenever FifoLevel (RegIrqFlags2 bit 5) drops. Only DIO0 of
+   * the RFM69 is connected, and that one cannot signal FifoLevel, so we
+   * have to poll. Every poll takes at least 4 us, see rfm69_sendarray().
+   * If we were too slow and the FIFO ran empty (FifoNotEmpty, bit 6,
+   * cleared) or the chip thinks it is done (PacketSent, bit 3), the rest
+   * would come too late: give up on this frame. */
+  while ((sent < length) && (maxreps > 0)) {
+    uint8_t reg28 = rfm69_readreg(0x28);
+    if (!(reg28 & 0x40) || (reg28 & 0x08)) {
+      console_printpgm_P(PSTR("![TX UNDERRUN]!"));
+      *ok = 0;
+      rfm69_settransmitter(0);
+      rfm69_clearfifo();
+      return ((((uint32_t)clock_ticksince(start) + 1) * 16UL) + 124UL) / 125UL;
+    }
+    if (reg28 & 0x20) {
+      maxreps--;
+      continue;
+    }
+    uint8_t n = ((length - sent) < STREAMCHUNK) ? (length - sent) : STREAMCHUNK;
+    fill(buf, n);
+    rfm69_writeburst(0x00, buf, n);
+    sent += n;
+  }
+  /* Wait for PacketSent */
+  while ((maxreps > 0) && !(rfm69_readreg(0x28) & 0x08)) {
+    maxreps--;
+  }
+  if (maxreps == 0) {
+    console_printpgm_P(PSTR("![TX TIMED OUT]!"));
+    *ok = 0;
+  }
+  rfm69_settransmitter(0);
+  return ((((uint32_t)clock_ticksince(start) + 1) * 16UL) + 124UL) / 125UL;
+}
+
+uint8_t rfm69_receive(uint8_t * data, uint8_t length, uint16_t timeoutms) {
+  /* RegRxTimeout1 and 2 count in units of 16 bit times. Timeout1 is the
+   * time from entering RX to RSSI detection, i.e. our window. Timeout2 is
+   * the time from RSSI detection to PayloadReady: preamble, sync word and
+   * payload, with 50% margin so a packet that has started is not cut off. */
+  uint32_t unitus = (16UL * 1000000UL) / curdatarate;
+  uint32_t t1 = (((uint32_t)timeoutms * 1000UL) + unitus - 1) / unitus;
+  uint32_t t2 = ((((uint32_t)length + 5) * 8 * 3 / 2) + 15) / 16;
+  /* Safety net in case the sequencer never signals anything: both
+   * timeouts, plus 50 ms, in timer ticks of 128 us. */
+  uint16_t maxticks = ((((t1 + t2) * unitus) / 1000UL) + 50UL) * 125UL / 16UL;
+  uint16_t start;
+  uint8_t res = 0;
+  if (t1 > 255) { t1 = 255; }
+  if (t1 == 0) { t1 = 1; }
+  rfm69_writereg(0x38, length); /* RegPayloadLength */
+  rfm69_writereg(0x2A, t1); /* RegRxTimeout1 */
+  rfm69_writereg(0x2B, t2); /* RegRxTimeout2 */
+  rfm69_clearfifo();
+  rfm69_setmode(MODE_RX);
+  start = clock_getticks();
+  while (clock_ticksince(start) <= maxticks) {
+    if (rfm69_readreg(0x28) & 0x04) { /* RegIrqFlags2: PayloadReady */
+      rfm69_readburst(0x00, data, length);
+      res = 1;
+      break;
+    }
+    if (rfm69_readreg(0x27) & 0x04) { /* RegIrqFlags1: Timeout */
+      break;
+    }
+  }
+  /* Back to standby. This also clears the Timeout flag. */
+  rfm69_setmode(MODE_STANDBY);
+  rfm69_writereg(0x2A, 0x00);
+  rfm69_writereg(0x2B, 0x00);
+  return res;
+}
+
+uint8_t rfm69_readrssi(void) {
+  uint8_t res = 0xff;
+  uint16_t maxreps = 1000;
+  /* Switch to RX, and wait for RxReady in RegIrqFlags1 */
+  rfm69_setmode(MODE_RX);
+  while (!(rfm69_readreg(0x27) & 0x40)) {
+    if (--maxreps == 0) { break; }
+  }
+  if (maxreps > 0) {
+    /* RegRssiConfig: RssiStart, then wait for RssiDone */
+    rfm69_writereg(0x23, 0x01);
+    while (!(rfm69_readreg(0x23) & 0x02)) {
+      if (--maxreps == 0) { break; }
+    }
+    if (maxreps > 0) {
+      res = rfm69_readreg(0x24); /* RegRssiValue */
+    }
+  }
+  rfm69_setmode(MODE_STANDBY);
+  return res;
+}
+
+void rfm69_spibench(uint16_t * regns, uint16_t * burstns) {
+  uint8_t buf[16];
+  uint16_t start;
+  rfm69_setsleep(0);
+  start = clock_getticks();
+  for (uint16_t i = 0; i < 1024; i++) {
+    rfm69_readreg(0x10); /* RegVersion */
+  }
+  /* 1024 accesses, 128000 ns per tick */
+  *regns = clock_ticksince(start) * 125U;
+  rfm69_clearfifo();
+  start = clock_getticks();
+  for (uint16_t i = 0; i < 256; i++) {
+    /* Write and read back, so the FIFO never overflows */
+    rfm69_writeburst(0x00, buf, sizeof(buf));
+    rfm69_readburst(0x00, buf, sizeof(buf));
+  }
+  /* 512 bursts */
+  *burstns = clock_ticksince(start) * 250U;
+  rfm69_clearfifo();
+  rfm69_setsleep(1);
 }
 
 void rfm69_initport(void) {
@@ -152,32 +461,39 @@ void rfm69_initport(void) {
   RFMDDR |= _BV(RFMPIN_OURSS);
 
   RFMPORT |= _BV(RFMPIN_SS);
+  /* The reset below forgets everything we ever wrote */
+  for (uint8_t i = 0; i < sizeof(shadowvalid); i++) {
+    shadowvalid[i] = 0;
+  }
   
   /* Enable hardware SPI, no need to manually do it.
-   * set master mode with rate clk/4 = 2 MHz (maximum of RFM69 is unknown) */
+   * set master mode with rate clk/2 = 4 MHz (SPI2X). The RFM69 can do up
+   * to 10 MHz, but clk/2 is the fastest the AVR can do. */
   SPCR = _BV(SPE) | _BV(MSTR);
-  SPSR = 0x00; /* To set SPI2X to 0, rest is read-only anyways */
+  SPSR = _BV(SPI2X); /* The rest is read-only anyways */
   
   _delay_us(200); /* 100us minimum time the RESET pin needs to be pulled high on the RFM */
   PORTD &= (uint8_t)~_BV(PD4);
 }
 
 void rfm69_initchip(void) {
-  /* RegOpMode -> standby. */
-  rfm69_writereg(0x01, 0x00 | 0x04);
+  /* RegOpMode -> standby. This is the first write, so that the shadow
+   * of RegOpMode is valid for rfm69_setmode(). */
+  rfm69_writereg(0x01, 0x00 | MODE_STANDBY);
   /* RegDataModul -> PacketMode, FSK, Shaping 0 */
   rfm69_writereg(0x02, 0x00);
   /* RegFDevMsb / RegFDevLsb -> 0x05C3 (90 kHz). */
   rfm69_writereg(0x05, 0x05);
   rfm69_writereg(0x06, 0xC3);
   /* RegPaLevel -> Pa0=0 Pa1=1 Pa2=0 Outputpower=31 -> 13 dbM */
-  rfm69_writereg(0x11, 0x5F);
+  rfm69_setpower(31);
   /* RegPaRamp -> 0x0c = 20us   default = 0x09 = 40us */
   /* rfm69_writereg(0x12, 0x0c); */
   /* RegOcp -> defaults (jeelink-sketch sets 0 but that seems wrong) */
   rfm69_writereg(0x13, 0x1a);
-  /* RegRxBw -> DccFreq 010   Mant 16   Exp 2 - this is a receiver-register,
-   * we do not really care about it */
+  /* RegRxBw -> DccFreq 010   Mant 16   Exp 2 = 125 kHz. This only matters
+   * for the downlink receive window (rfm69_receive()), and is plenty for
+   * our 90 kHz deviation at 17 kbit/s. */
   rfm69_writereg(0x19, 0x42);
   /* RegDioMapping2 -> disable clkout (but thats the default anyways) */
   rfm69_writereg(0x26, 0x07);
@@ -208,26 +524,35 @@ void rfm69_initchip(void) {
   rfm69_writereg(0x3D, 0x12);
   /* RegTestDagc -> improvedlowbeta0 - I haven't got the faintest... */
   /* rfm69_writereg(0x6F, 0x30); */
-  /* Set Frequency */
+  rfm69_setfrequency(RFM_FREQUENCY);
+  rfm69_setdatarate(RFM_DATARATE);
+
+  rfm69_clearfifo();
+}
+
+void rfm69_setfrequency(uint32_t khz) {
   /* The datasheet is horrible to read at that point, never stating a clear
    * formula ready for use. */
   /* F(Step) = F(XOSC) / (2 ** 19)      2 ** 19 = 524288
-   * F(forreg) = FREQUENCY_IN_HZ / F(Step) */
-  uint32_t freq = round((1000.0 * RFM_FREQUENCY) / (32000000.0 / 524288.0));
-  /* (Alternative calculation from JeeNode library:)
-   * Frequency steps are in units of (32,000,000 >> 19) = 61.03515625 Hz
-   * use multiples of 64 to avoid multi-precision arithmetic, i.e. 3906.25 Hz
-   * due to this, the lower 6 bits of the calculated factor will always be 0
-   * this is still 4 ppm, i.e. well below the radio's 32 MHz crystal accuracy */
-  /* uint32_t freq = (((RFM_FREQUENCY * 1000) << 2) / (32000000UL >> 11)) << 6; */
-  rfm69_writereg(0x07, (freq >> 16) & 0xff);
-  rfm69_writereg(0x08, (freq >>  8) & 0xff);
-  rfm69_writereg(0x09, (freq >>  0) & 0xff);
-  /* Set Datarate - the whole floating point mess seems to be optimized out 
-   * by gcc at compile time, thank god. */
-  uint16_t dr = (uint16_t)round(32000000.0 / RFM_DATARATE);
-  rfm69_writereg(0x03, (dr >> 8));
-  rfm69_writereg(0x04, (dr & 0xff));
+   * F(forreg) = FREQUENCY_IN_HZ / F(Step)
+   *           = FREQUENCY_IN_KHZ * 524288 / 32000
+   *           = FREQUENCY_IN_KHZ * 2048 / 125
+   * FREQUENCY_IN_KHZ * 2048 still fits into 32 bits for all frequencies
+   * the RFM69 can do, so there is no need for floating point here. */
+  uint32_t freq = ((khz * 2048UL) + 62UL) / 125UL;
+  uint8_t regs[3] = { (freq >> 16) & 0xff, (freq >> 8) & 0xff, freq & 0xff };
+  rfm69_writeburst(0x07, regs, sizeof(regs)); /* RegFrfMsb/Mid/Lsb */
+}
 
-  rfm69_clearfifo();
+void rfm69_setdatarate(uint32_t bps) {
+  uint16_t dr = (uint16_t)((32000000UL + (bps / 2)) / bps);
+  uint8_t regs[2] = { dr >> 8, dr & 0xff };
+  rfm69_writeburst(0x03, regs, sizeof(regs)); /* RegBitrateMsb/Lsb */
+  curdatarate = bps;
+}
+
+void rfm69_setpower(uint8_t p) {
+  /* RegPaLevel -> Pa0=0 Pa1=1 Pa2=0 Outputpower=p.
+   * p=31 results in 13 dBm, every step below is 1 dB less. */
+  rfm69_writereg(0x11, 0x40 | (p & 0x1f));
 }
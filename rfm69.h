@@ -11,8 +11,58 @@ void rfm69_initport(void);
 void rfm69_initchip(void);
 void rfm69_clearfifo(void);
 void rfm69_settransmitter(uint8_t e);
-void rfm69_sendarray(uint8_t * data, uint8_t length);
+/* Send length bytes. Returns how long the transmitter was on, in ms.
+ * With automatic transmission, this returns as soon as the frame is in
+ * the FIFO, and the time is an estimate. */
+uint16_t rfm69_sendarray(uint8_t * data, uint8_t length);
+/* Automatic transmission: the RFM69 stays in sleep mode and uses its
+ * AutoModes to send on its own once the FIFO has been filled, and goes
+ * back to sleep when done. The next register write waits until the frame
+ * is out. */
+void rfm69_setautotx(uint8_t on);
+/* Send a frame of length bytes that does not fit into the FIFO. fill is
+ * called to produce the next n bytes into buf, while the transmission is
+ * already running, so it has to be quick. Returns the airtime in ms like
+ * rfm69_sendarray(), and leaves the radio in standby. *ok is set to 0 if
+ * the FIFO ran empty before we could refill it: the frame is broken then
+ * and has been aborted. */
+uint16_t rfm69_sendstream(uint8_t length, void (*fill)(uint8_t * buf, uint8_t n), uint8_t * ok);
 void rfm69_setsleep(uint8_t s);
+/* Start waking up from sleep, without waiting for the oscillator: That
+ * takes up to a ms, which we can use for preparing the frame. Filling the
+ * FIFO works meanwhile, anything that needs the oscillator waits for it
+ * with rfm69_waitready(). rfm69_setsleep(0) does both at once. */
+void rfm69_wakeup(void);
+void rfm69_waitready(void);
+/* Listen for a packet of exactly length bytes for timeoutms milliseconds
+ * (at most 255 * 16 bit times, i.e. about 236 ms at 17241 bit/s).
+ * Returns 1 if one was received into data, 0 on timeout. The radio is
+ * left in standby. */
+uint8_t rfm69_receive(uint8_t * data, uint8_t length, uint16_t timeoutms);
+/* Read a register from the chip */
 uint8_t rfm69_readreg(uint8_t reg);
+/* Same, but configuration registers we have written come from our
+ * shadow copy instead, without any SPI traffic. */
+uint8_t rfm69_readregcached(uint8_t reg);
+/* Read or write len consecutive registers starting at reg, in one SPI
+ * transaction. For the FIFO (reg 0) all bytes go to / come from the FIFO. */
+void rfm69_readburst(uint8_t reg, uint8_t * data, uint8_t len);
+void rfm69_writeburst(uint8_t reg, const uint8_t * data, uint8_t len);
+/* Compare the shadow copy with the chip: returns the first register from
+ * from onwards that differs, or -1 if all match. */
+int16_t rfm69_checkshadow(uint8_t from);
+/* Briefly switch to RX and measure the signal strength on the channel.
+ * Returns -2 * RSSI in dBm (i.e. 180 = -90 dBm, higher is weaker), or
+ * 0xff if the measurement did not work. The radio is left in standby. */
+uint8_t rfm69_readrssi(void);
+/* Measure how long a register access and a 16 byte FIFO burst take on
+ * the SPI bus, in ns. This takes about 20 ms, and leaves the RFM69
+ * asleep. */
+void rfm69_spibench(uint16_t * regns, uint16_t * burstns);
+/* Change the frequency (in kHz), datarate (in bit/s) and the output
+ * power (0-31, 31 = 13 dBm) after rfm69_initchip(). */
+void rfm69_setfrequency(uint32_t khz);
+void rfm69_setdatarate(uint32_t bps);
+void rfm69_setpower(uint8_t p);
 
 #endif /* _RFM69_H_ */
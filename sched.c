@@ -0,0 +1,174 @@
+/* $Id: sched.c $
+ * A very simple cooperative scheduler, see sched.h
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include "clock.h"
+#include "sched.h"
+
+struct schedtask {
+  void (*func)(void);
+  uint32_t due;       /* when this needs to run next */
+  uint32_t interval;  /* 0 = not periodic */
+  uint8_t enabled;
+  /* Statistics */
+  uint16_t runs;
+  uint16_t maxruntime;
+  uint16_t maxlate;
+};
+static struct schedtask tasks[SCHED_NUMTASKS];
+
+/* Set when we need to look at our tasks, either because a deadline
+ * passed or because sched_wake() was called. */
+static volatile uint8_t schedwakeup = 1;
+/* Tasks that were woken with sched_wake(), one bit per task. */
+static volatile uint8_t wokentasks = 0;
+
+void sched_timer_noirq(void)
+{
+  schedwakeup = 1;
+}
+
+void sched_settask(uint8_t task, void (*func)(void), uint32_t interval)
+{
+  tasks[task].func = func;
+  tasks[task].interval = interval;
+  sched_runin(task, interval);
+}
+
+void sched_setinterval(uint8_t task, uint32_t interval)
+{
+  tasks[task].interval = interval;
+}
+
+void sched_runin(uint8_t task, uint32_t delay)
+{
+  tasks[task].due = clock_now() + delay;
+  tasks[task].enabled = 1;
+  schedwakeup = 1;
+}
+
+void sched_stop(uint8_t task)
+{
+  tasks[task].enabled = 0;
+}
+
+void sched_wake(uint8_t task)
+{
+  uint8_t sreg = SREG;
+  cli();
+  wokentasks |= (uint8_t)(1 << task);
+  schedwakeup = 1;
+  SREG = sreg;
+}
+
+void sched_run(void)
+{
+  uint32_t now;
+  uint32_t next;
+  uint8_t woken;
+
+  cli();
+  if (!schedwakeup) { /* Some other interrupt woke us. Not our business. */
+    sei();
+    return;
+  }
+  schedwakeup = 0;
+  woken = wokentasks;
+  wokentasks = 0;
+  now = clock_now_noirq();
+  sei();
+  for (uint8_t i = 0; i < SCHED_NUMTASKS; i++) {
+    struct schedtask * t = &tasks[i];
+    uint8_t runit = 0;
+    if (t->func == 0) {
+      continue;
+    }
+    if (woken & (uint8_t)(1 << i)) {
+      runit = 1;
+    }
+    if (t->enabled && CLOCK_HASPASSED(t->due, now)) {
+      uint32_t late = now - t->due;
+      if (late > t->maxlate) {
+        t->maxlate = (late > 0xffff) ? 0xffff : late;
+      }
+      if (t->interval > 0) {
+        t->due += t->interval;
+        if (CLOCK_HASPASSED(t->due, now)) { /* We're way behind, don't try to catch up */
+          t->due = now + t->interval;
+        }
+      } else {
+        t->enabled = 0;
+      }
+      runit = 1;
+    }
+    if (runit) {
+      uint16_t start = clock_getticks();
+      uint16_t rt;
+      t->func();
+      rt = clock_ticksince(start);
+      if (rt > t->maxruntime) {
+        t->maxruntime = rt;
+      }
+      t->runs++;
+    }
+  }
+  /* Find out when we need to wake up next. */
+  cli();
+  now = clock_now_noirq();
+  next = now + CLOCK_PERIOD;
+  for (uint8_t i = 0; i < SCHED_NUMTASKS; i++) {
+    if ((tasks[i].func != 0) && tasks[i].enabled
+     && CLOCK_ISBEFORE(tasks[i].due, next)) {
+      next = tasks[i].due;
+    }
+  }
+  if (clock_setalarm_noirq(next)) {
+    /* Something is already due again. */
+    schedwakeup = 1;
+  }
+  sei();
+}
+
+void sched_sleep(void)
+{
+  cli();
+  if (schedwakeup) { /* Something is due, don't sleep */
+    sei();
+    return;
+  }
+  /* The instruction after sei() is always executed before any pending
+   * interrupt, so we cannot miss a wakeup here. */
+  sei();
+  sleep_cpu();
+}
+
+/* This can only be called safely with interrupts disabled - remember that! */
+uint16_t sched_getruns_noirq(uint8_t task)
+{
+  return tasks[task].runs;
+}
+
+/* This can only be called safely with interrupts disabled - remember that! */
+uint16_t sched_getmaxruntime_noirq(uint8_t task)
+{
+  return tasks[task].maxruntime;
+}
+
+/* This can only be called safely with interrupts disabled - remember that! */
+uint16_t sched_getmaxlate_noirq(uint8_t task)
+{
+  return tasks[task].maxlate;
+}
+
+/* This can only be called safely with interrupts disabled - remember that! */
+void sched_resetstats_noirq(void)
+{
+  for (uint8_t i = 0; i < SCHED_NUMTASKS; i++) {
+    tasks[i].runs = 0;
+    tasks[i].maxruntime = 0;
+    tasks[i].maxlate = 0;
+  }
+}
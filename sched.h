@@ -0,0 +1,54 @@
+/* $Id: sched.h $
+ * A very simple cooperative scheduler: A fixed table of tasks, each with
+ * the time it is due next. Timer3 is programmed to wake us exactly when
+ * the next task is due, and the tasks are then run from the main loop.
+ */
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include "clock.h"
+
+/* The tasks. Lower numbers are run first if several are due at once. */
+#define SCHED_TASK_SAMPLE       0 /* checks the geiger counter for an alarm */
+#define SCHED_TASK_TRANSMIT     1 /* measure and send a packet */
+#define SCHED_TASK_HOUSEKEEPING 2 /* journal, apply settings */
+#define SCHED_TASK_CONSOLE      3 /* the USB console */
+#define SCHED_TASK_VARINT       4 /* variable integration time measurement */
+#define SCHED_TASK_HISTORY      5 /* upload the geiger history */
+#define SCHED_NUMTASKS          6
+
+/* Called from the clock interrupts in clock.c: a deadline might have
+ * passed. */
+void sched_timer_noirq(void);
+
+/* Set the function for a task and make it run every interval
+ * (in CLOCK_HZ units). With interval 0 the task only runs once, when it
+ * is started with sched_runin() or sched_wake(). */
+void sched_settask(uint8_t task, void (*func)(void), uint32_t interval);
+/* Change the interval of a task, without changing when it is due next. */
+void sched_setinterval(uint8_t task, uint32_t interval);
+/* Make task due in delay CLOCK_HZ units from now. */
+void sched_runin(uint8_t task, uint32_t delay);
+/* Do not run task until it is started again with sched_runin() */
+void sched_stop(uint8_t task);
+/* Run task as soon as possible. This may be called from an interrupt. */
+void sched_wake(uint8_t task);
+
+/* Run all tasks that are due, then program the timer for the next one.
+ * Call this from the main loop every time we wake up. It returns quickly
+ * if the wakeup was not for us. */
+void sched_run(void);
+/* Go to sleep, unless something became due while we were running the
+ * tasks. Interrupts need to be enabled when calling this. */
+void sched_sleep(void);
+
+/* Statistics for the console. runtime is in Timer3 ticks (128 us),
+ * lateness in CLOCK_HZ units. These can only be called safely with
+ * interrupts disabled! */
+uint16_t sched_getruns_noirq(uint8_t task);
+uint16_t sched_getmaxruntime_noirq(uint8_t task);
+uint16_t sched_getmaxlate_noirq(uint8_t task);
+void sched_resetstats_noirq(void);
+
+#endif /* _SCHED_H_ */
@@ -0,0 +1,111 @@
+/* $Id: sysmon.c $
+ * System monitoring: stack usage, free RAM and how long interrupts stay
+ * disabled.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "sysmon.h"
+
+/* The pattern we fill unused RAM with. */
+#define STACKPAINT 0xc5
+
+/* These are all defined by the linker / avr-libc. */
+extern uint8_t _end;          /* end of our static variables */
+extern uint8_t __stack;       /* top of RAM, where the stack starts */
+extern uint8_t __heap_start;
+extern char * __brkval;       /* end of heap, 0 if malloc was never used */
+
+#if defined(SYSMON_CLITIMING)
+static uint16_t clistart;
+static uint16_t climax[SYSMON_CS_COUNT];
+#endif /* SYSMON_CLITIMING */
+
+/* Paint all RAM between the end of our static variables and the top of
+ * RAM with a known pattern, so that we can later see how deep the stack
+ * went. This runs from .init3, i.e. before .data and .bss are initialized,
+ * and nothing is on the stack yet - so we can simply paint all of it. */
+void sysmon_paintstack(void) __attribute__((naked)) __attribute__((section(".init3")));
+void sysmon_paintstack(void) {
+  uint8_t * p = &_end;
+  while (p <= &__stack) {
+    *p = STACKPAINT;
+    p++;
+  }
+}
+
+uint16_t sysmon_stackunused(void)
+{
+  const uint8_t * p = &_end;
+  uint16_t res = 0;
+  /* Note: a value that just happens to be STACKPAINT at the border will
+   * make us overestimate this by a byte or so. Not a problem. */
+  while ((p <= &__stack) && (*p == STACKPAINT)) {
+    p++;
+    res++;
+  }
+  return res;
+}
+
+uint16_t sysmon_stackmaxused(void)
+{
+  return (uint16_t)(&__stack - &_end) + 1 - sysmon_stackunused();
+}
+
+uint16_t sysmon_freeram(void)
+{
+  uint8_t * heapend = (uint8_t *)__brkval;
+  if (heapend == 0) {
+    heapend = &__heap_start;
+  }
+  return (uint16_t)SP - (uint16_t)heapend;
+}
+
+uint16_t sysmon_heapused(void)
+{
+  if (__brkval == 0) {
+    return 0;
+  }
+  return (uint16_t)((uint8_t *)__brkval - &__heap_start);
+}
+
+#if defined(SYSMON_CLITIMING)
+/* Both of these are called with interrupts disabled, so we can access
+ * TCNT1 and our variables without further precautions. */
+void sysmon_clistart(void)
+{
+  clistart = TCNT1;
+}
+
+void sysmon_cliend(uint8_t which)
+{
+  uint16_t d = TCNT1 - clistart;
+  if (d > climax[which]) {
+    climax[which] = d;
+  }
+}
+
+/* This can only be called safely with interrupts disabled - remember that! */
+uint16_t sysmon_getclimax_noirq(uint8_t which)
+{
+  return climax[which];
+}
+
+/* This can only be called safely with interrupts disabled - remember that! */
+void sysmon_resetclimax_noirq(void)
+{
+  for (uint8_t i = 0; i < SYSMON_CS_COUNT; i++) {
+    climax[i] = 0;
+  }
+}
+#endif /* SYSMON_CLITIMING */
+
+void sysmon_init(void)
+{
+#if defined(SYSMON_CLITIMING)
+  /* Timer1 runs freely in normal mode with prescaler /8, i.e. 1 MHz. */
+  PRR0 &= (uint8_t)~_BV(PRTIM1);
+  TCCR1A = 0x00;
+  TCCR1B = _BV(CS11);
+#endif /* SYSMON_CLITIMING */
+}
@@ -0,0 +1,52 @@
+/* $Id: sysmon.h $
+ * System monitoring: stack usage, free RAM and how long interrupts stay
+ * disabled. Mainly useful for finding out how much room is left before
+ * enlarging buffers or histories.
+ */
+
+#ifndef _SYSMON_H_
+#define _SYSMON_H_
+
+#include <avr/interrupt.h>
+
+/* The code sections with interrupts disabled that we keep track of. */
+#define SYSMON_CS_GEIGERAVG    0 /* geiger.c: calculating the averages */
+#define SYSMON_CS_CLOCKREAD    1 /* clock.c: reading the time */
+#define SYSMON_CS_CONSOLEWORK  2 /* console.c: CDC_Task and command processing */
+#define SYSMON_CS_CONSOLEPRINT 3 /* console.c: the printing wrappers */
+#define SYSMON_CS_COUNT        4
+
+/* General initialization */
+void sysmon_init(void);
+
+/* Number of bytes between our static variables and the stack that have
+ * never been touched since the last reset. This is our safety margin. */
+uint16_t sysmon_stackunused(void);
+/* The maximum stack depth seen since reset, in bytes. */
+uint16_t sysmon_stackmaxused(void);
+/* Free RAM between the heap (or the static variables if the heap is
+ * unused) and the current stack pointer. */
+uint16_t sysmon_freeram(void);
+/* Bytes allocated from the heap. */
+uint16_t sysmon_heapused(void);
+
+#if defined(SYSMON_CLITIMING)
+/* Timing of the sections with interrupts disabled. This uses Timer1,
+ * running at F_CPU/8, i.e. with a resolution of 1 us. Times longer
+ * than 65 ms will overflow, but if we ever have those, we have
+ * bigger problems anyways. */
+void sysmon_clistart(void);
+void sysmon_cliend(uint8_t which);
+/* The longest time (in timer1 ticks, i.e. microseconds) interrupts stayed
+ * disabled in section which. These need to be called with IRQs disabled
+ * (which is the case in the console command processing). */
+uint16_t sysmon_getclimax_noirq(uint8_t which);
+void sysmon_resetclimax_noirq(void);
+#define SYSMON_CLI(w) do { cli(); sysmon_clistart(); } while (0)
+#define SYSMON_SEI(w) do { sysmon_cliend(w); sei(); } while (0)
+#else /* SYSMON_CLITIMING */
+#define SYSMON_CLI(w) cli()
+#define SYSMON_SEI(w) sei()
+#endif /* SYSMON_CLITIMING */
+
+#endif /* _SYSMON_H_ */
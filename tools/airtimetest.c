@@ -0,0 +1,54 @@
+/* $Id: tools/airtimetest.c $
+ * Host test for airtime.c: feeds it airtime at known times and checks
+ * the hour sum, in particular in the first hour after boot, when not all
+ * slots have been used yet. Exits with 1 if anything is off.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "clock.h"
+
+static uint32_t now;
+uint32_t clock_now(void) { return now; }
+uint32_t clock_now_noirq(void) { return now; }
+
+#include "airtime.c"
+
+static int failed = 0;
+
+static void expect(const char * what, uint32_t got, uint32_t want)
+{
+  if (got != want) {
+    printf("FAIL %s at %lu s: %lu ms, expected %lu ms\n", what,
+           (unsigned long)(now / CLOCK_HZ), (unsigned long)got, (unsigned long)want);
+    failed = 1;
+  }
+}
+
+int main(void)
+{
+  /* First hour: one frame of 100 ms every minute */
+  for (uint32_t m = 0; m < 60; m++) {
+    now = CLOCK_SECONDS(m * 60);
+    airtime_add(100);
+    expect("first hour", airtime_used(), (m + 1) * 100);
+    expect("first hour (noirq)", airtime_used_noirq(), (m + 1) * 100);
+  }
+  /* From now on, a whole slot of 5 frames drops out every 5 minutes */
+  for (uint32_t m = 60; m < 180; m++) {
+    now = CLOCK_SECONDS(m * 60);
+    airtime_add(100);
+    expect("later", airtime_used(), (55 + (m % 5) + 1) * 100);
+  }
+  /* Silence for more than an hour empties the window */
+  now += CLOCK_SECONDS(3600);
+  expect("after silence", airtime_used(), 0);
+  airtime_add(100);
+  expect("after silence", airtime_used(), 100);
+  /* Budget */
+  expect("allow", airtime_allow(AIRTIME_PRIO_LOW, 17900), 1);
+  expect("refuse", airtime_allow(AIRTIME_PRIO_LOW, 17901), 0);
+  expect("refused", airtime_getrefused_noirq(), 1);
+  printf("%s\n", (failed) ? "airtimetest failed" : "airtimetest ok");
+  return failed;
+}
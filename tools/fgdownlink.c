@@ -0,0 +1,151 @@
+/* $Id: tools/fgdownlink.c $
+ * Host tool that builds (and checks) downlink command packets for
+ * foxgeig2018, see downlink.h.
+ * The packets are printed as hex. With -o they are also written to a
+ * file or tty, e.g. a transmitter, or one end of a pty pair
+ * ("socat -d -d pty,raw,echo=0 pty,raw,echo=0") that stands in for the
+ * radio when testing. Since the sensor only listens for a few ms after
+ * it transmits, -r repeats the packet every -t ms.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include "downlink.h"
+
+static const struct {
+  const char * name;
+  uint8_t cmd;
+} cmdnames[] = {
+  { "txinterval", DOWNLINK_CMD_TXINTERVAL },
+  { "rfmpower",   DOWNLINK_CMD_RFMPOWER },
+  { "txformat",   DOWNLINK_CMD_TXFORMAT },
+  { "txavg",      DOWNLINK_CMD_TXAVG },
+  { "alarmcpm",   DOWNLINK_CMD_ALARMCPM },
+  { "rxevery",    DOWNLINK_CMD_RXEVERY },
+  { "histupload", DOWNLINK_CMD_HISTUPLOAD },
+};
+#define NUMCMDS (sizeof(cmdnames) / sizeof(cmdnames[0]))
+
+static void usage(void)
+{
+  fprintf(stderr,
+    "Usage: fgdownlink -k key -i sensorid -c counter [-o file] [-r repeats] [-t ms] command value\n"
+    "       fgdownlink -k key -i sensorid -l lastcounter -v packet\n"
+    "key and packet are hex (32 digits each). The counter must be higher than\n"
+    "that of the last command the sensor accepted.\n"
+    "Commands:");
+  for (size_t i = 0; i < NUMCMDS; i++) {
+    fprintf(stderr, " %s", cmdnames[i].name);
+  }
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static int parsehex(const char * s, uint8_t * buf, size_t len)
+{
+  if (strlen(s) != (len * 2)) {
+    return 0;
+  }
+  for (size_t i = 0; i < len; i++) {
+    unsigned int b;
+    if (sscanf(&s[i * 2], "%2x", &b) != 1) {
+      return 0;
+    }
+    buf[i] = b;
+  }
+  return 1;
+}
+
+static void printhex(const uint8_t * buf, size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    printf("%02x", buf[i]);
+  }
+  printf("\n");
+}
+
+int main(int argc, char ** argv)
+{
+  uint8_t key[DOWNLINK_KEYLEN];
+  uint8_t pkt[DOWNLINK_LEN];
+  struct downlinkcmd c;
+  int haskey = 0;
+  long id = -1;
+  unsigned long counter = 0;
+  unsigned long lastcounter = 0;
+  const char * outfile = NULL;
+  const char * verify = NULL;
+  long repeats = 1;
+  long interval = 100;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "k:i:c:l:o:r:t:v:")) != -1) {
+    switch (opt) {
+    case 'k': haskey = parsehex(optarg, key, sizeof(key)); break;
+    case 'i': id = strtol(optarg, NULL, 0); break;
+    case 'c': counter = strtoul(optarg, NULL, 0); break;
+    case 'l': lastcounter = strtoul(optarg, NULL, 0); break;
+    case 'o': outfile = optarg; break;
+    case 'r': repeats = strtol(optarg, NULL, 0); break;
+    case 't': interval = strtol(optarg, NULL, 0); break;
+    case 'v': verify = optarg; break;
+    default: usage();
+    }
+  }
+  if (!haskey || (id < 0) || (id > 255)) {
+    usage();
+  }
+  if (verify != NULL) { /* Check a packet the way the sensor does */
+    if (!parsehex(verify, pkt, sizeof(pkt))) {
+      usage();
+    }
+    if (!downlink_parse(key, id, lastcounter, pkt, &c)) {
+      printf("rejected\n");
+      return 2;
+    }
+    printf("counter %lu command %u value %lu\n", (unsigned long)c.counter,
+           c.cmd, (unsigned long)c.value);
+    return 0;
+  }
+  if (((argc - optind) != 2) || (counter == 0)) {
+    usage();
+  }
+  c.counter = counter;
+  c.cmd = 0;
+  for (size_t i = 0; i < NUMCMDS; i++) {
+    if (strcasecmp(argv[optind], cmdnames[i].name) == 0) {
+      c.cmd = cmdnames[i].cmd;
+    }
+  }
+  if (c.cmd == 0) {
+    usage();
+  }
+  c.value = strtoul(argv[optind + 1], NULL, 0);
+  downlink_build(key, id, &c, pkt);
+  printhex(pkt, sizeof(pkt));
+  if (outfile != NULL) {
+    FILE * f = fopen(outfile, "wb");
+    if (f == NULL) {
+      perror(outfile);
+      return 1;
+    }
+    for (long r = 0; r < repeats; r++) {
+      if (r > 0) {
+        struct timespec ts = { interval / 1000, (interval % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+      }
+      if ((fwrite(pkt, 1, sizeof(pkt), f) != sizeof(pkt)) || (fflush(f) != 0)) {
+        perror(outfile);
+        return 1;
+      }
+    }
+    fclose(f);
+  }
+  return 0;
+}
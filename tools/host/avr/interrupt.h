@@ -0,0 +1,5 @@
+/* $Id: tools/host/avr/interrupt.h $
+ * Stand-in for the AVR header, see io.h.
+ */
+#define cli()
+#define sei()
@@ -0,0 +1,5 @@
+/* $Id: tools/host/avr/io.h $
+ * Stand-in for the AVR header, so firmware modules that do not touch
+ * the hardware can be built on the host for tests (see tools/).
+ */
+#include <stdint.h>
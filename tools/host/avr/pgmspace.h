@@ -0,0 +1,8 @@
+/* $Id: tools/host/avr/pgmspace.h $
+ * Stand-in for the AVR header, see io.h: there is only one address space.
+ */
+#include <string.h>
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define memcpy_P memcpy
@@ -0,0 +1,271 @@
+/* $Id: tools/slotsim.c $
+ * Discrete event simulation of many foxgeig2018 sharing one channel,
+ * to compare the transmit timing modes (setting txslot, see main.c).
+ * Every unit boots at a random time, and its crystal is off by up to
+ * +-50 ppm. A frame is lost if it overlaps any other frame (no capture
+ * effect). Optionally, LaCrosse sensors (one short frame every 4 s)
+ * share the channel too. With -c, the units listen before talk: if
+ * another frame is on air, they back off for a random time, like
+ * setting lbt does.
+ * Prints the delivery rate and the longest run of consecutive lost
+ * frames of any unit, against the number of units.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/* These match main.c and the default settings */
+#define CLOCK_HZ 64
+#define CLOCK_PERIOD (6 * CLOCK_HZ)
+#define TXINTERVAL 5
+#define TXSLOTS 64
+#define TXJITTER 2
+#define BITRATE 17241.0
+/* 3 bytes preamble, 2 bytes sync, 12 bytes frame, plus PA ramp up */
+#define FRAMETIME ((17 * 8) / BITRATE + 0.0003)
+/* LaCrosse: 5 bytes payload */
+#define LACROSSEPERIOD 4.0
+#define LACROSSETIME ((10 * 8) / BITRATE)
+
+/* Listen before talk, as in main.c */
+#define LBTMAXTRIES 5
+#define LBTMINBACKOFF 5
+#define LBTMAXBACKOFF 40
+/* Time from checking the channel to being on air: switching back to
+ * standby, filling the FIFO, starting the transmitter. Frames that start
+ * in that time are not noticed. */
+#define LBTTURNAROUND 0.0005
+/* How many of the latest frames we look at for the channel check */
+#define RECENTFRAMES 16
+
+#define MODE_LACROSSE 255
+
+struct unit {
+  uint8_t mode;
+  uint8_t id;
+  double clockscale;  /* 1 + drift */
+  double next;        /* time of the next transmission, s */
+  uint32_t sent;
+  uint32_t lost;
+  uint32_t lostrun;
+  uint32_t maxlostrun;
+  uint8_t tries;      /* channel found busy for the current frame */
+};
+
+struct frame {
+  double start;
+  double end;
+  struct unit * u;
+  int lost;
+};
+
+static uint64_t rngstate = 88172645463325252ULL;
+
+static uint64_t rng(void)
+{
+  rngstate ^= rngstate << 13;
+  rngstate ^= rngstate >> 7;
+  rngstate ^= rngstate << 17;
+  return rngstate;
+}
+
+static double rnguniform(void)
+{
+  return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Delay until the next transmission, in seconds of the unit's clock */
+static double nextdelay(struct unit * u)
+{
+  uint32_t t;
+  switch (u->mode) {
+  case 0: /* random: 4, 5 or 6 ticks */
+    t = TXINTERVAL * CLOCK_PERIOD;
+    switch (rng() & 3) {
+    case 0: t -= CLOCK_PERIOD; break;
+    case 3: t += CLOCK_PERIOD; break;
+    }
+    return (double)t / CLOCK_HZ;
+  case 1: /* slotted */
+    t = (TXINTERVAL * CLOCK_PERIOD) + (u->id % TXSLOTS) + (rng() % TXJITTER);
+    return (double)t / CLOCK_HZ;
+  default: /* LaCrosse */
+    return LACROSSEPERIOD;
+  }
+}
+
+/* The event queue: a binary heap of units, ordered by next */
+static struct unit ** heap;
+static int heapsize;
+
+static void heapdown(int i)
+{
+  for (;;) {
+    int l = (2 * i) + 1;
+    int m = i;
+    if ((l < heapsize) && (heap[l]->next < heap[m]->next)) { m = l; }
+    if (((l + 1) < heapsize) && (heap[l + 1]->next < heap[m]->next)) { m = l + 1; }
+    if (m == i) { return; }
+    struct unit * tmp = heap[i];
+    heap[i] = heap[m];
+    heap[m] = tmp;
+    i = m;
+  }
+}
+
+static void lose(struct frame * f)
+{
+  if (f->lost || (f->u->mode == MODE_LACROSSE)) {
+    f->lost = 1;
+    return;
+  }
+  f->lost = 1;
+  f->u->lost++;
+  f->u->lostrun++;
+  if (f->u->lostrun > f->u->maxlostrun) {
+    f->u->maxlostrun = f->u->lostrun;
+  }
+}
+
+/* Simulate n units in mode plus nlacrosse LaCrosse sensors for hours.
+ * Returns the delivery rate, and the longest loss run in *maxrun. */
+static int lbt = 0;
+
+/* Is any of the recent frames on air at time t? */
+static int onair(const struct frame * recent, double t)
+{
+  for (int i = 0; i < RECENTFRAMES; i++) {
+    if ((recent[i].start <= t) && (t < recent[i].end)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static double simulate(int mode, int n, int nlacrosse, double hours, uint32_t * maxrun)
+{
+  int total = n + nlacrosse;
+  struct unit * units = calloc(total, sizeof(struct unit));
+  struct frame prev; /* the earlier frame that ends last */
+  struct frame recent[RECENTFRAMES];
+  int recentpos = 0;
+  uint32_t sent = 0;
+  uint32_t lost = 0;
+  heap = calloc(total, sizeof(struct unit *));
+  heapsize = total;
+  for (int i = 0; i < total; i++) {
+    struct unit * u = &units[i];
+    u->mode = (i < n) ? mode : MODE_LACROSSE;
+    u->id = i;
+    u->clockscale = 1.0 + ((rnguniform() - 0.5) * 100e-6);
+    u->next = rnguniform() * ((u->mode == MODE_LACROSSE) ? LACROSSEPERIOD : 40.0);
+    heap[i] = u;
+  }
+  for (int i = (total / 2) - 1; i >= 0; i--) {
+    heapdown(i);
+  }
+  memset(&prev, 0, sizeof(prev));
+  prev.end = -1.0;
+  memset(recent, 0, sizeof(recent));
+  while (heap[0]->next < (hours * 3600.0)) {
+    struct unit * u = heap[0];
+    struct frame f;
+    /* next is when the unit checks the channel (or would), for all units
+     * the frame starts a bit later */
+    f.start = u->next + LBTTURNAROUND;
+    f.end = f.start + ((u->mode == MODE_LACROSSE) ? LACROSSETIME : FRAMETIME);
+    f.u = u;
+    f.lost = 0;
+    if (u->mode != MODE_LACROSSE) {
+      if (lbt && onair(recent, u->next) && (u->tries < LBTMAXTRIES)) {
+        /* Somebody is on air, try again a little later */
+        u->tries++;
+        u->next += (LBTMINBACKOFF + (rng() % (LBTMAXBACKOFF - LBTMINBACKOFF + 1))) / 1000.0;
+        heapdown(0);
+        continue;
+      }
+      u->tries = 0;
+      u->sent++;
+    }
+    /* Frames arrive in order of their start, so this one overlaps an
+     * earlier one exactly if it starts before the end of the earlier
+     * frame that ends last. */
+    if (f.start < prev.end) {
+      lose(&f);
+      lose(&prev);
+    } else if ((prev.u != NULL) && !prev.lost) {
+      prev.u->lostrun = 0; /* prev is final now, and it got through */
+    }
+    if (f.end > prev.end) {
+      prev = f;
+    }
+    recent[recentpos] = f;
+    recentpos = (recentpos + 1) % RECENTFRAMES;
+    u->next += nextdelay(u) * u->clockscale;
+    heapdown(0);
+  }
+  *maxrun = 0;
+  for (int i = 0; i < n; i++) {
+    sent += units[i].sent;
+    lost += units[i].lost;
+    if (units[i].maxlostrun > *maxrun) {
+      *maxrun = units[i].maxlostrun;
+    }
+  }
+  free(units);
+  free(heap);
+  return (sent > 0) ? (1.0 - ((double)lost / sent)) : 0.0;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+    "Usage: slotsim [-c] [-h hours] [-l lacrossesensors] [-s seed] [fleetsize...]\n"
+    "-c: listen before talk\n"
+    "Default: 24 hours, no LaCrosse sensors, fleet sizes 10 20 50 100 200 500\n");
+  exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+  static const int defsizes[] = { 10, 20, 50, 100, 200, 500 };
+  double hours = 24.0;
+  int nlacrosse = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "ch:l:s:")) != -1) {
+    switch (opt) {
+    case 'c': lbt = 1; break;
+    case 'h': hours = atof(optarg); break;
+    case 'l': nlacrosse = atoi(optarg); break;
+    case 's': rngstate = strtoull(optarg, NULL, 0) | 1; break;
+    default: usage();
+    }
+  }
+  printf("%.0f hours, %d LaCrosse sensors, listen before talk %s\n",
+         hours, nlacrosse, (lbt) ? "on" : "off");
+  printf("units | random: delivered maxlostrun | slotted: delivered maxlostrun\n");
+  for (int i = 0; ; i++) {
+    int n;
+    uint32_t run0, run1;
+    if (optind < argc) {
+      if ((optind + i) >= argc) { break; }
+      n = atoi(argv[optind + i]);
+    } else {
+      if (i >= (int)(sizeof(defsizes) / sizeof(defsizes[0]))) { break; }
+      n = defsizes[i];
+    }
+    if (n <= 0) {
+      usage();
+    }
+    double d0 = simulate(0, n, nlacrosse, hours, &run0);
+    double d1 = simulate(1, n, nlacrosse, hours, &run1);
+    printf("%5d |         %6.2f%%  %10u |          %6.2f%%  %10u\n",
+           n, d0 * 100.0, run0, d1 * 100.0, run1);
+  }
+  return 0;
+}